@@ -5,23 +5,57 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 /*** Section 2: Defines ***/
 
 #define WRITEAM_VERSION "0.0.1"
 #define WRITEAM_TAB_STOP 8
 #define WRITEAM_QUIT_TIMES 3
+#define WRITEAM_HL_CHECKPOINT 128
+#define WRITEAM_RX_CHECKPOINT 256
+#define WRITEAM_HL_BATCH 65536
+#define WRITEAM_LONG_LINE (1 << 16)
+#define WRITEAM_SEARCH_THREADS 8
+#define WRITEAM_SEARCH_SPLIT 16384
+#define WRITEAM_INDEX_MIN_SIZE (16 << 20)
+#define WRITEAM_INDEX_BITS 18
+#define WRITEAM_INDEX_GROUP_BITS 6
+#define WRITEAM_INDEX_LISTS 8
+#define WRITEAM_REGEX_STATES 512
+#define WRITEAM_SAVE_IOV 1024
+#define WRITEAM_JOURNAL_BATCH (1 << 20)
+#define WRITEAM_JOURNAL_INTERVAL 250
+#define WRITEAM_STREAM_CHUNK (4 << 20)
+#define WRITEAM_UNDO_LIMIT (16 << 20)
+#define WRITEAM_PASTE_TIMEOUT 5000
 
 #define CTRL_KEY(k) ((k) & 0x1f)
+#define ROW_CHAR(row, at) ((row)->gapLen && (at) >= (row)->gapAt ? (row)->chars[(at) + (row)->gapLen] : (row)->chars[(at)])
+#define ROW_HL(row, at) ((row)->hl[(row)->gapLen && (at) >= (row)->gapAt ? (at) + (row)->gapLen : (at)])
 
 enum editorKey {
   BACKSPACE = 127,
@@ -33,7 +67,9 @@ enum editorKey {
   HOME_KEY,
   END_KEY,
   PAGE_UP,
-  PAGE_DOWN
+  PAGE_DOWN,
+  PASTE_START,
+  PASTE_END
 };
 
 enum editorHighlight {
@@ -50,6 +86,38 @@ enum editorHighlight {
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
 #define HL_HIGHLIGHT_STRINGS (1<<1)
 
+#define CELL_INVERSE (1<<7)
+#define CELL_WIDE_TAIL 0x110000
+#define CELL_STYLES (2 * (HL_MATCH + 1))
+
+#define HL_CLASS_SEPARATOR (1<<0)
+#define HL_CLASS_DIGIT (1<<1)
+#define HL_CLASS_QUOTE (1<<2)
+#define HL_CLASS_DELIMITER (1<<3)
+
+enum undoType {
+  UNDO_INSERT,
+  UNDO_DELETE,
+  UNDO_ERASE,
+  UNDO_INSERT_ROW,
+  UNDO_DELETE_ROW
+};
+
+enum regexOp {
+  RE_CLASS,
+  RE_BOL,
+  RE_EOL,
+  RE_MATCH,
+  RE_SPLIT,
+  RE_JMP,
+  RE_CAT,
+  RE_ALT,
+  RE_STAR,
+  RE_PLUS,
+  RE_QUEST,
+  RE_EMPTY
+};
+
 /*** Section 3: Data ***/
 
 struct editorSyntax {
@@ -62,16 +130,217 @@ struct editorSyntax {
   int flags;
 };
 
+struct editorKeyword {
+  char *word;
+  int length;
+  unsigned char hl;
+};
+
+struct hlCheckpoint {
+  int pos;
+  unsigned char inString;
+  unsigned char inComment;
+  unsigned char previousSep;
+  unsigned char previousHl;
+};
+
+struct hlWindow {
+  unsigned char *hl;
+  int from;
+  int to;
+};
+
+struct hlLexer {
+  char *scs;
+  char *mcs;
+  char *mce;
+  int scsLength;
+  int mcsLength;
+  int mceLength;
+  struct hlWindow *window;
+};
+
+struct rxCheckpoint {
+  int cx;
+  int rx;
+};
+
+struct editorCell {
+  unsigned int ch;
+  unsigned char style;
+};
+
 typedef struct erow {
-  int idx;
   int size;
-  int rsize;
   char *chars;
-  char *render;
   unsigned char *hl;
   int hlOpenComment;
+  int hlStale;
+  struct hlCheckpoint *hlCheckpoints;
+  int hlNumCheckpoints;
+  int longLine;
+  struct rxCheckpoint *rxCheckpoints;
+  int rxNumCheckpoints;
+  int rxCapCheckpoints;
+  int mapped;
+  int pinned;
+  int gapAt;
+  int gapLen;
+  int id;
+  int indexDirty;
+  struct erow *left;
+  struct erow *right;
+  struct erow *parent;
+  unsigned int priority;
+  int count;
 } erow;
 
+struct undoRecord {
+  int type;
+  int group;
+  int run;
+  int row;
+  int col;
+  int length;
+  int previous;
+  int cursorX;
+  int cursorY;
+};
+
+struct journalHeader {
+  char magic[8];
+  long long inode;
+  long long size;
+  long long mtime;
+  long long follow;
+};
+
+struct journalRecord {
+  int type;
+  int row;
+  int col;
+  int length;
+};
+
+struct editorMatchRow {
+  int at;
+  erow *row;
+  int count;
+  int first;
+};
+
+struct editorPosting {
+  int *groups;
+  int len;
+  int cap;
+};
+
+struct regexNode {
+  int op;
+  struct regexNode *left;
+  struct regexNode *right;
+  unsigned char set[32];
+};
+
+struct regexParser {
+  const char *s;
+  struct regexNode *nodes;
+  int numNodes;
+  int error;
+};
+
+struct regexInst {
+  int op;
+  int x;
+  int y;
+  unsigned char set[32];
+};
+
+struct editorRegex {
+  struct regexInst *prog;
+  int numInsts;
+  unsigned char first[32];
+  int firstByte;
+  int skip;
+};
+
+struct regexDfaState {
+  int *pcs;
+  int numPcs;
+  int match;
+  int matchAtEnd;
+  int next[256];
+};
+
+struct regexThread {
+  int pc;
+  int start;
+};
+
+struct regexCache {
+  struct regexDfaState *states;
+  int numStates;
+  int *table;
+  int initial;
+  int idle;
+  int flushes;
+  int *set;
+  int numSet;
+  int *stack;
+  int *mark;
+  int markGen;
+  struct regexThread *current;
+  struct regexThread *next;
+  int *onList;
+};
+
+struct editorSearchJob {
+  const char *query;
+  int queryLength;
+  struct editorRegex *regex;
+  int start;
+  int end;
+  struct editorMatchRow *candidates;
+  struct editorMatchRow *found;
+  int numFound;
+  int total;
+  int record;
+  int *offsets;
+  int numOffsets;
+  int offsetCap;
+};
+
+struct editorSaveJob {
+  struct iovec *rows;
+  int numRows;
+  char *target;
+  char *tempName;
+  mode_t mode;
+  int dirty;
+  struct timespec started;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  long long total;
+  long long written;
+  off_t journalOffset;
+  int done;
+  int error;
+  char **garbage;
+  int numGarbage;
+  int garbageCap;
+};
+
+struct editorStream {
+  int fd;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  struct iovec *slices;
+  int numSlices;
+  int sliceCap;
+  long long bytes;
+  int done;
+};
+
 struct editorConfig {
   int cursorX, cursorY;
   int rx;
@@ -80,12 +349,84 @@ struct editorConfig {
   int screenRows;
   int screenCols;
   int numRows;
-  erow *row;
+  erow *root;
+  erow *freeRows;
+  erow **rowById;
+  int numRowIds;
+  int rowIdCap;
+  int *freeRowIds;
+  int numFreeRowIds;
+  int freeRowIdCap;
+  erow *gapRow;
+  erow **staleRows;
+  int numStaleRows;
+  erow *hlFrontier;
+  erow *matchRow;
+  int matchAt;
+  int matchLen;
+  int matchCount;
+  int matchNumber;
+  int findRegex;
+  struct editorPosting *index;
+  erow *indexFrontier;
+  erow **indexDirty;
+  int numIndexDirty;
+  int indexDirtyCap;
+  char *undo;
+  int undoHead;
+  int undoLast;
+  int undoCurrent;
+  int undoTail;
+  int undoGroup;
+  int undoCursorX;
+  int undoCursorY;
+  int undoDropGroup;
+  int undoReplaying;
+  erow *undoRow;
+  pthread_mutex_t hlLock;
+  pthread_cond_t hlCond;
+  int hlIdle;
+  int hlBusy;
+  int hlPending;
+  int hlRedraw;
+  char *map;
+  size_t mapSize;
+  struct editorStream *stream;
+  int followFile;
+  int followFd;
+  int followWatch;
+  off_t followOffset;
+  struct editorSaveJob *save;
+  int saveGeneration;
+  int saveProgress;
+  char *journalName;
+  int journalFd;
+  char *journal;
+  int journalLen;
+  int journalCap;
+  int journalReplaying;
+  int journalKept;
+  struct timespec journalFlushed;
   int dirty;
   char *fileName;
+  struct editorCell *frame;
+  struct editorCell *shadow;
+  unsigned char *hlWindow;
+  int hlWindowCap;
+  char styleEscape[CELL_STYLES][12];
+  int styleLength[CELL_STYLES];
+  char input[4096];
+  int inputLen;
+  int inputPos;
+  int pasteOpen;
   char statusmsg[80];
   time_t statusmsg_time;
   struct editorSyntax *syntax;
+  struct editorKeyword *keywordTable;
+  unsigned int keywordMask;
+  unsigned int keywordSeed;
+  int keywordMaxLength;
+  unsigned char byteClass[256];
   struct termios orig_termios;
 };
 
@@ -113,9 +454,23 @@ struct editorSyntax HLDB[] = {
 
 /*** Section 5: Prototypes ***/
 
+int editorUpdateSyntax(erow *row);
+void editorReleaseRows();
+int editorAcquireRows();
+void editorIndexTouch(erow *row);
+void editorIndexEdit(erow *row, int at, int delta);
+void editorUndoRecord(int type, erow *row, int col, const char *text, int length, int run);
+int editorSavePoll();
+int editorStreamPoll();
+int editorFollowPoll();
+void editorFollowStart();
+void editorJournalFlush(int force);
+void editorJournalRecord(int type, int row, int col, const char *text, int length);
+int editorIndexPending();
+int editorIndexBatch();
 void editorSetStatusMessage(const char *fmt, ...);
 void editorRefreshScreen();
-char *editorPrompt(char *prompt, void (*callback)(char *, int));
+char *editorPrompt(char *prompt, void (*callback)(char *, int), int allowEmpty);
 
 /*** Section 6: Terminal ***/
 
@@ -128,6 +483,8 @@ void die(const char *s) {
 }
 
 void disableRawMode() {
+  write(STDOUT_FILENO, "\x1b[?2004l", 8);
+
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1) {
     die("tcsetattr");
   }
@@ -151,82 +508,177 @@ void enableRawMode() {
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) {     
     die("tcsetattr");
   }
+
+  write(STDOUT_FILENO, "\x1b[?2004h", 8);
 }
 
-int editorReadKey() {
-  int nread;
-  char c;
+int editorReadInput() {
+  if (E.inputPos > 0) {
+    memmove(E.input, &E.input[E.inputPos], E.inputLen - E.inputPos);
+    E.inputLen -= E.inputPos;
+    E.inputPos = 0;
+  }
 
-  while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-    if (nread == -1 && errno != EAGAIN) {
-      die("read");
-    }
+  int nread = read(STDIN_FILENO, &E.input[E.inputLen], sizeof(E.input) - E.inputLen);
+
+  if (nread == -1 && errno != EAGAIN) {
+    die("read");
   }
 
-  if (c == '\x1b') {
-    char seq[3];
+  if (nread > 0) {
+    E.inputLen += nread;
+  }
 
-    if (read(STDIN_FILENO, &seq[0], 1) != 1) {
-      return '\x1b';
-    }
+  return nread > 0;
+}
 
-    if (read(STDIN_FILENO, &seq[1], 1) != 1) {
-      return '\x1b';
-    }
+int editorDecodeKey(int *key, int force) {
+  char *seq = &E.input[E.inputPos];
+  int avail = E.inputLen - E.inputPos;
 
-    if (seq[0] == '[') {
-      if (seq[1] >= '0' && seq[1] <= '9') {
-        if (read(STDIN_FILENO, &seq[2], 1) != 1) {
-          return '\x1b';
-        }
+  if (avail == 0) {
+    return 0;
+  }
 
-        if (seq[2] == '~') {
-          switch (seq[1]) {
-            case '1':
-              return HOME_KEY;
-            case '3':
-              return DEL_KEY;
-            case '4':
-              return END_KEY;
-            case '5':
-              return PAGE_UP;
-            case '6':
-              return PAGE_DOWN;
-            case '7':
-              return HOME_KEY;
-            case '8':
-              return END_KEY;
-          }
+  if (seq[0] != '\x1b') {
+    *key = seq[0];
+    E.inputPos++;
+    return 1;
+  }
+
+  *key = '\x1b';
+
+  if (avail >= 2 && seq[1] == '[') {
+    int i = 2;
+
+    while (i < avail && seq[i] >= 0x30 && seq[i] <= 0x3f) {
+      i++;
+    }
+
+    if (i < avail) {
+      int paramLength = i - 2;
+      char final = seq[i];
+
+      E.inputPos += i + 1;
+
+      if (final == '~' && paramLength == 1) {
+        switch (seq[2]) {
+          case '1':
+            *key = HOME_KEY;
+            break;
+          case '3':
+            *key = DEL_KEY;
+            break;
+          case '4':
+            *key = END_KEY;
+            break;
+          case '5':
+            *key = PAGE_UP;
+            break;
+          case '6':
+            *key = PAGE_DOWN;
+            break;
+          case '7':
+            *key = HOME_KEY;
+            break;
+          case '8':
+            *key = END_KEY;
+            break;
         }
-      } else {
-        switch (seq[1]) {
+      } else if (final == '~' && paramLength == 3 && !memcmp(&seq[2], "200", 3)) {
+        *key = PASTE_START;
+      } else if (final == '~' && paramLength == 3 && !memcmp(&seq[2], "201", 3)) {
+        *key = PASTE_END;
+      } else if (paramLength == 0) {
+        switch (final) {
           case 'A':
-            return ARROW_UP;
+            *key = ARROW_UP;
+            break;
           case 'B':
-            return ARROW_DOWN;
+            *key = ARROW_DOWN;
+            break;
           case 'C':
-            return ARROW_RIGHT;
+            *key = ARROW_RIGHT;
+            break;
           case 'D':
-            return ARROW_LEFT;
+            *key = ARROW_LEFT;
+            break;
           case 'H':
-            return HOME_KEY;
+            *key = HOME_KEY;
+            break;
           case 'F':
-            return END_KEY;
+            *key = END_KEY;
+            break;
         }
       }
-    } else if (seq[0] == 'O') {
-      switch (seq[1]) {
-        case 'H':
-          return HOME_KEY;
-        case 'F':
-          return END_KEY;
+
+      return 1;
+    }
+  } else if (avail >= 3 && seq[1] == 'O') {
+    E.inputPos += 3;
+
+    switch (seq[2]) {
+      case 'H':
+        *key = HOME_KEY;
+        break;
+      case 'F':
+        *key = END_KEY;
+        break;
+    }
+
+    return 1;
+  } else if (avail >= 2 && seq[1] != 'O') {
+    E.inputPos += 2;
+    return 1;
+  }
+
+  if (!force) {
+    return 0;
+  }
+
+  E.inputPos = E.inputLen;
+
+  return 1;
+}
+
+int editorKeysPending() {
+  return E.inputPos < E.inputLen;
+}
+
+int editorReadKey() {
+  int key;
+
+  if (!editorKeysPending()) {
+    editorReleaseRows();
+
+    while (!editorReadInput()) {
+      int redraw = editorAcquireRows();
+      editorJournalFlush(0);
+      redraw |= editorStreamPoll();
+      redraw |= editorFollowPoll();
+
+      if (editorSavePoll() || redraw) {
+        editorRefreshScreen();
       }
+
+      editorReleaseRows();
     }
 
-    return '\x1b';
-  } else {
-    return c;
+    editorAcquireRows();
+  }
+
+  if (E.pasteOpen) {
+    return PASTE_START;
+  }
+
+  while (!editorDecodeKey(&key, E.inputPos == 0 && E.inputLen == sizeof(E.input))) {
+    if (!editorReadInput()) {
+      editorDecodeKey(&key, 1);
+      break;
+    }
   }
+
+  return key;
 }
 
 int getCursorPosition(int *rows, int *cols) {
@@ -278,594 +730,4316 @@ int getWindowSize(int *rows, int *cols) {
   }
 }
 
-/*** Section 7: Syntax Highlighting ***/
+/*** Section 7: Document ***/
 
-int isSeparator(int c) {
-  return isspace(c) || c == '\0' || strchr(",.()+-/*=%<>[];", c) != NULL;
+int docCount(erow *node) {
+  return node ? node->count : 0;
 }
 
-void editorUpdateSyntax(erow *row) {
-  row->hl = realloc(row->hl, row->rsize);
-  memset(row->hl, HL_NORMAL, row->rsize);
+void docPull(erow *node) {
+  node->count = 1 + docCount(node->left) + docCount(node->right);
 
-  if (E.syntax == NULL) {
-    return;
+  if (node->left) {
+    node->left->parent = node;
   }
 
-  char **keywords = E.syntax->keywords;
+  if (node->right) {
+    node->right->parent = node;
+  }
+}
 
-  char *scs = E.syntax->singlelineCommentStart;
-  char *mcs = E.syntax->multilineCommentStart;
-  char *mce = E.syntax->multilineCommentEnd;
+erow *docMerge(erow *a, erow *b) {
+  if (a == NULL) {
+    return b;
+  }
 
-  int scsLength = scs ? strlen(scs) : 0;
-  int mcsLength = mcs ? strlen(mcs) : 0;
-  int mceLength = mce ? strlen(mce) : 0;
+  if (b == NULL) {
+    return a;
+  }
 
-  int previousSep = 1;
-  int inString = 0;
-  int inComment = (row->idx > 0 && E.row[row->idx - 1].hlOpenComment);
+  if (a->priority > b->priority) {
+    a->right = docMerge(a->right, b);
+    docPull(a);
+    return a;
+  }
 
-  int i = 0;
-  while (i < row->rsize) {
-    char c = row->render[i];
-    unsigned char previousHl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+  b->left = docMerge(a, b->left);
+  docPull(b);
+  return b;
+}
 
-    if (scsLength && !inString && !inComment) {
-      if (!strncmp(&row->render[i], scs, scsLength)) {
-        memset(&row->hl[i], HL_COMMENT, row->rsize - i);
-        break;
-      }
-    }
+void docSplit(erow *node, int at, erow **a, erow **b) {
+  if (node == NULL) {
+    *a = NULL;
+    *b = NULL;
+    return;
+  }
 
-    if (mcsLength && mceLength && !inString) {
-      if (inComment) {
-        row->hl[i] = HL_MLCOMMENT;
+  if (docCount(node->left) < at) {
+    docSplit(node->right, at - docCount(node->left) - 1, &node->right, b);
+    docPull(node);
+    *a = node;
+  } else {
+    docSplit(node->left, at, a, &node->left);
+    docPull(node);
+    *b = node;
+  }
+}
 
-        if (!strncmp(&row->render[i], mce, mceLength)) {
-          memset(&row->hl[i], HL_MLCOMMENT, mceLength);
-          i += mceLength;
-          inComment = 0;
-          previousSep = 1;
-          continue;
-        } else {
-          i++;
-          continue;
-        }
-      } else if (!strncmp(&row->render[i], mcs, mcsLength)) {
-        memset(&row->hl[i], HL_MLCOMMENT, mcsLength);
-        i += mcsLength;
-        inComment = 1;
-        continue;
-      }
-    }
+void docSetRoot(erow *root) {
+  E.root = root;
+  E.numRows = docCount(root);
 
-    if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
-      if (inString) {
-        row->hl[i] = HL_STRING;
+  if (root) {
+    root->parent = NULL;
+  }
+}
 
-        if (c == '\\' && i + 1 < row->rsize) {
-          row->hl[i + 1] = HL_STRING;
-          i += 2;
-          continue;
-        }
+erow *docRowAt(int at) {
+  erow *node = E.root;
 
-        if (c == inString) {
-          inString = 0;
-        }
+  if (at < 0 || at >= docCount(node)) {
+    return NULL;
+  }
 
-        i++;
-        previousSep = 1;
-        continue;
-      } else {
-        if (c == '"' || c == '\'') {
-          inString = c;
-          row->hl[i] = HL_STRING;
-          i++;
-          continue;
-        }
-      }
-    }
+  while (node) {
+    int leftCount = docCount(node->left);
 
-    if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-      if ((isdigit(c) && (previousSep || previousHl == HL_NORMAL)) || (c == '.' && previousHl == HL_NUMBER)) {
-        row->hl[i] = HL_NUMBER;
-        i++;
-        previousSep = 0;
-        continue;
-      }
+    if (at < leftCount) {
+      node = node->left;
+    } else if (at == leftCount) {
+      return node;
+    } else {
+      at -= leftCount + 1;
+      node = node->right;
+    }
   }
 
-  if (previousSep) {
-    int j;
-    for (j = 0; keywords[j]; j++) {
-      int kLength = strlen(keywords[j]);
-      int kw2 = keywords[j][kLength - 1] == '|';
+  return NULL;
+}
 
-      if (kw2) {
-        kLength--;
-      }
+int docRowIndex(erow *row) {
+  int at = docCount(row->left);
 
-      if (!strncmp(&row->render[i], keywords[j], kLength) && isSeparator(row->render[i + kLength])) {
-        memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, kLength);
-        i+= kLength;
-        break;
-      }
+  for (erow *node = row; node->parent; node = node->parent) {
+    if (node == node->parent->right) {
+      at += docCount(node->parent->left) + 1;
     }
+  }
 
-    if (keywords[j] != NULL) {
-      previousSep = 0;
-      continue;
+  return at;
+}
+
+erow *docNextRow(erow *row) {
+  if (row->right) {
+    row = row->right;
+
+    while (row->left) {
+      row = row->left;
     }
+
+    return row;
   }
 
-    previousSep = isSeparator(c);
-    i++;
+  while (row->parent && row == row->parent->right) {
+    row = row->parent;
   }
 
-  int changed = (row->hlOpenComment != inComment);
-  row->hlOpenComment = inComment;
+  return row->parent;
+}
+
+erow *docPrevRow(erow *row) {
+  if (row->left) {
+    row = row->left;
+
+    while (row->right) {
+      row = row->right;
+    }
 
-  if (changed && row->idx + 1 < E.numRows) {
-    editorUpdateSyntax(&E.row[row->idx + 1]);
+    return row;
   }
-}
 
-int editorSyntaxToColor(int hl) {
-  switch (hl) {
-    case HL_COMMENT:
-      return 36;
-    case HL_MLCOMMENT:
-      return 36;
-    case HL_KEYWORD1:
-      return 33;
-    case HL_KEYWORD2:
-      return 32;
-    case HL_STRING:
-      return 35;
-    case HL_NUMBER:
-      return 31;
-    case HL_MATCH:
-      return 34;
-    default:
-      return 37;
+  while (row->parent && row == row->parent->left) {
+    row = row->parent;
   }
+
+  return row->parent;
 }
 
-void editorSelectSyntaxHighlight() {
-  E.syntax = NULL;
+void docInitNode(erow *node) {
+  memset(node, 0, sizeof(erow));
+  node->priority = rand();
+  node->count = 1;
 
-  if (E.fileName == NULL) {
+  if (E.numFreeRowIds > 0) {
+    node->id = E.freeRowIds[--E.numFreeRowIds];
+    E.rowById[node->id] = node;
     return;
   }
 
-  char *ext = strrchr(E.fileName, '.');
-
-  for (unsigned int i = 0; i < HLDB_ENTRIES; i++) {
-    struct editorSyntax *s = &HLDB[i];
-    unsigned int j = 0;
-
-    while (s->fileMatch[j]) {
-      int isExt = (s->fileMatch[j][0] == '.');
+  if (E.numRowIds == E.rowIdCap) {
+    E.rowIdCap = E.rowIdCap ? E.rowIdCap * 2 : 1024;
+    E.rowById = realloc(E.rowById, sizeof(erow *) * E.rowIdCap);
+  }
 
-      if ((isExt && ext && !strcmp(ext, s->fileMatch[j])) || (!isExt && strstr(E.fileName, s->fileMatch[j]))) {
-        E.syntax = s;
+  node->id = E.numRowIds;
+  E.rowById[E.numRowIds++] = node;
+}
 
-        for (int fileRow = 0; fileRow < E.numRows; fileRow++) {
-          editorUpdateSyntax(&E.row[fileRow]);
-        }
+erow *docBuild(erow *rows, int numRows) {
+  erow **stack = malloc(sizeof(erow *) * (numRows + 1));
+  int depth = 0;
 
-        return;
-      }
+  for (int i = 0; i < numRows; i++) {
+    erow *node = &rows[i];
+    erow *last = NULL;
 
-      j++;
+    while (depth > 0 && stack[depth - 1]->priority < node->priority) {
+      last = stack[--depth];
+      docPull(last);
     }
-  }
-}
 
-/*** Section 8: Row Operations ***/
+    node->left = last;
 
-int editorRowCxToRx(erow *row, int cx) {
-  int rx = 0;
-
-  for (int i = 0; i < cx; i++) {
-    if (row->chars[i] == '\t') {
-      rx += (WRITEAM_TAB_STOP - 1) - (rx % WRITEAM_TAB_STOP);
+    if (depth > 0) {
+      stack[depth - 1]->right = node;
     }
 
-    rx++;
+    stack[depth++] = node;
   }
 
-  return rx;
-}
-
-int editorRowRxToCx(erow *row, int rx) {
-  int cur_rx = 0;
-  int cx;
-
-  for (cx = 0; cx < row->size; cx++) {
-    if (row->chars[cx] == '\t') {
-      cur_rx += (WRITEAM_TAB_STOP - 1) - (cur_rx % WRITEAM_TAB_STOP);
-    }
+  while (depth > 1) {
+    docPull(stack[--depth]);
+  }
 
-    cur_rx++;
+  erow *root = NULL;
 
-    if (cur_rx > rx) {
-      return cx;
-    }
+  if (depth == 1) {
+    root = stack[0];
+    docPull(root);
   }
 
-  return cx;
-}
+  free(stack);
 
-void editorUpdateRow(erow *row) {
-  int tabs = 0;
-  
-  for (int i = 0; i < row->size; i++) {
-    if (row->chars[i] == '\t') {
-      tabs++;
-    }
-  }
+  return root;
+}
 
-  free(row->render);
-  row->render = malloc(row->size + tabs * (WRITEAM_TAB_STOP - 1) + 1);
+void docAppendRows(erow *rows, int numRows) {
+  docSetRoot(docMerge(E.root, docBuild(rows, numRows)));
+}
 
-  int idx = 0;
+erow *docInsertRow(int at) {
+  erow *row = E.freeRows;
 
-  for (int i = 0; i < row->size; i++) {
-    if (row->chars[i] == '\t') {
-      row->render[idx++] = ' ';
-      while (idx % WRITEAM_TAB_STOP != 0) {
-        row->render[idx++] = ' ';
-      }
-    } else {
-      row->render[idx++] = row->chars[i];
-    }
+  if (row) {
+    E.freeRows = row->right;
+  } else {
+    row = malloc(sizeof(erow));
   }
 
-  row->render[idx] = '\0';
-  row->rsize = idx;
+  docInitNode(row);
 
-  editorUpdateSyntax(row);
+  erow *a, *b;
+  docSplit(E.root, at, &a, &b);
+  docSetRoot(docMerge(docMerge(a, row), b));
+
+  return row;
 }
 
-void editorInsertRow(int at, char *s, size_t len) {
-  if (at < 0 || at > E.numRows) {
-    return;
-  }
+void docRemoveRow(erow *row) {
+  erow *a, *b, *c;
+  docSplit(E.root, docRowIndex(row), &a, &b);
+  docSplit(b, 1, &b, &c);
+  docSetRoot(docMerge(a, c));
 
-  E.row = realloc(E.row, sizeof(erow) * (E.numRows + 1));
-  memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numRows - at));
+  E.rowById[row->id] = NULL;
 
-  for (int i = at + 1; i <= E.numRows; i++) {
-    E.row[i].idx++;
+  if (E.numFreeRowIds == E.freeRowIdCap) {
+    E.freeRowIdCap = E.freeRowIdCap ? E.freeRowIdCap * 2 : 1024;
+    E.freeRowIds = realloc(E.freeRowIds, sizeof(int) * E.freeRowIdCap);
   }
 
-  E.row[at].idx = at;
+  E.freeRowIds[E.numFreeRowIds++] = row->id;
 
-  E.row[at].size = len;
-  E.row[at].chars = malloc(len + 1);
-  memcpy(E.row[at].chars, s, len);
-  E.row[at].chars[len] = '\0';
+  row->right = E.freeRows;
+  E.freeRows = row;
+}
 
-  E.row[at].rsize = 0;
-  E.row[at].render = NULL;
-  E.row[at].hl = NULL;
-  E.row[at].hlOpenComment = 0;
-  editorUpdateRow(&E.row[at]);
+/*** Section 8: Syntax Highlighting ***/
 
-  E.numRows++;
-  E.dirty++;
+int isSeparator(int c) {
+  return isspace(c) || c == '\0' || strchr(",.()+-/*=%<>[];", c) != NULL;
 }
 
-void editorFreeRow(erow *row) {
-  free(row->render);
-  free(row->chars);
-  free(row->hl);
-}
+unsigned int editorKeywordHash(unsigned int seed, const char *s, int len) {
+  unsigned int h = seed ^ 2166136261u;
 
-void editorDelRow(int at) {
-  if (at < 0 || at >= E.numRows) {
-    return;
+  for (int i = 0; i < len; i++) {
+    h = (h ^ (unsigned char) s[i]) * 16777619u;
   }
 
-  editorFreeRow(&E.row[at]);
-  memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numRows - at - 1));
+  return h;
+}
+
+void editorCompileKeywords(char **keywords) {
+  int numKeywords = 0;
 
-  for (int i = at; i < E.numRows - 1; i++) {
-    E.row[i].idx--;
+  while (keywords[numKeywords]) {
+    numKeywords++;
   }
 
-  E.numRows--;
-  E.dirty++;
-}
+  unsigned int size = 8;
 
-void editorRowInsertChar(erow *row, int at, int c) {
-  if (at < 0 || at > row->size) {
-    at = row->size;
+  while (size < (unsigned int) numKeywords * 2) {
+    size *= 2;
   }
 
-  row->chars = realloc(row->chars, row->size + 2);
-  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-  row->size++;
-  row->chars[at] = c;
-  editorUpdateRow(row);
+  free(E.keywordTable);
+  E.keywordMaxLength = 0;
 
-  E.dirty++;
-}
+  for (;; size *= 2) {
+    E.keywordTable = calloc(size, sizeof(struct editorKeyword));
+    E.keywordMask = size - 1;
 
-void editorRowAppendString(erow *row, char *s, size_t len) {
-  row->chars = realloc(row->chars, row->size + len + 1);
-  memcpy(&row->chars[row->size], s, len);
-  row->size += len;
-  row->chars[row->size] = '\0';
-  editorUpdateRow(row);
-  E.dirty++;
-}
+    for (E.keywordSeed = 1; E.keywordSeed <= 256; E.keywordSeed++) {
+      int j;
 
-void editorRowDelChar(erow *row, int at) {
-  if (at < 0 || at >= row->size) {
+      for (j = 0; j < numKeywords; j++) {
+        int length = strlen(keywords[j]);
+        int kw2 = keywords[j][length - 1] == '|';
+
+        if (kw2) {
+          length--;
+        }
+
+        struct editorKeyword *k = &E.keywordTable[editorKeywordHash(E.keywordSeed, keywords[j], length) & E.keywordMask];
+
+        if (k->word) {
+          break;
+        }
+
+        k->word = keywords[j];
+        k->length = length;
+        k->hl = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+
+        if (length > E.keywordMaxLength) {
+          E.keywordMaxLength = length;
+        }
+      }
+
+      if (j == numKeywords) {
+        return;
+      }
+
+      memset(E.keywordTable, 0, sizeof(struct editorKeyword) * size);
+    }
+
+    free(E.keywordTable);
+  }
+}
+
+void editorCompileByteClasses(struct editorSyntax *syntax) {
+  for (int c = 0; c < 256; c++) {
+    unsigned char class = 0;
+
+    if (isSeparator(c)) {
+      class |= HL_CLASS_SEPARATOR;
+    }
+
+    if (isdigit(c)) {
+      class |= HL_CLASS_DIGIT;
+    }
+
+    if (c == '"' || c == '\'') {
+      class |= HL_CLASS_QUOTE;
+    }
+
+    E.byteClass[c] = class;
+  }
+
+  if (syntax->singlelineCommentStart && syntax->singlelineCommentStart[0]) {
+    E.byteClass[(unsigned char) syntax->singlelineCommentStart[0]] |= HL_CLASS_DELIMITER;
+  }
+
+  if (syntax->multilineCommentStart && syntax->multilineCommentStart[0]) {
+    E.byteClass[(unsigned char) syntax->multilineCommentStart[0]] |= HL_CLASS_DELIMITER;
+  }
+}
+
+int editorScanBytes(const char *s, int len, char a, char b) {
+  int i = 0;
+
+#if defined(__AVX2__)
+  __m256i wideA = _mm256_set1_epi8(a);
+  __m256i wideB = _mm256_set1_epi8(b);
+
+  for (; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) &s[i]);
+    unsigned int mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, wideA), _mm256_cmpeq_epi8(v, wideB)));
+
+    if (mask) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+#endif
+
+#if defined(__SSE2__)
+  __m128i vecA = _mm_set1_epi8(a);
+  __m128i vecB = _mm_set1_epi8(b);
+
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) &s[i]);
+    unsigned int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, vecA), _mm_cmpeq_epi8(v, vecB)));
+
+    if (mask) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+#endif
+
+  for (; i < len; i++) {
+    if (s[i] == a || s[i] == b) {
+      return i;
+    }
+  }
+
+  return len;
+}
+
+int editorRowScan(erow *row, int at, int limit, char a, char b) {
+  if (at >= limit) {
+    return limit;
+  }
+
+  if (row->gapLen && at < row->gapAt) {
+    int end = limit < row->gapAt ? limit : row->gapAt;
+    int found = at + editorScanBytes(&row->chars[at], end - at, a, b);
+
+    if (found < end || end == limit) {
+      return found;
+    }
+
+    at = end;
+  }
+
+  int offset = (row->gapLen && at >= row->gapAt) ? row->gapLen : 0;
+
+  return at + editorScanBytes(&row->chars[at + offset], limit - at, a, b);
+}
+
+int editorRowMatch(erow *row, int at, const char *s, int len) {
+  if (at + len > row->size) {
+    return 0;
+  }
+
+  if (row->gapLen == 0) {
+    return !memcmp(&row->chars[at], s, len);
+  }
+
+  for (int i = 0; i < len; i++) {
+    if (ROW_CHAR(row, at + i) != s[i]) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+void editorRowSetHl(erow *row, int at, int hl, int len) {
+  if (row->gapLen == 0) {
+    memset(&row->hl[at], hl, len);
     return;
   }
 
-  memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-  row->size--;
-  editorUpdateRow(row);
-  E.dirty++;
+  for (int i = 0; i < len; i++) {
+    ROW_HL(row, at + i) = hl;
+  }
 }
 
-/*** Section 9: Editor Operations ***/
+int editorMatchKeyword(erow *row, int at, int *length) {
+  unsigned int h = E.keywordSeed ^ 2166136261u;
+  int len = 0;
 
-void editorInsertChar(int c) {
-  if (E.cursorY == E.numRows) {
-    editorInsertRow(E.numRows, "", 0);
+  while (at + len < row->size) {
+    char c = ROW_CHAR(row, at + len);
+
+    if (E.byteClass[(unsigned char) c] & HL_CLASS_SEPARATOR) {
+      break;
+    }
+
+    if (len == E.keywordMaxLength) {
+      return HL_NORMAL;
+    }
+
+    h = (h ^ (unsigned char) c) * 16777619u;
+    len++;
   }
-  editorRowInsertChar(&E.row[E.cursorY], E.cursorX
-, c);
-  E.cursorX++;
+
+  struct editorKeyword *k = &E.keywordTable[h & E.keywordMask];
+
+  if (len == 0 || k->length != len || !editorRowMatch(row, at, k->word, len)) {
+    return HL_NORMAL;
+  }
+
+  *length = len;
+
+  return k->hl;
 }
 
-void editorInsertNewLine() {
-  if (E.cursorX
- == 0) {
-    editorInsertRow(E.cursorY, "", 0);
+void editorLexInit(struct hlLexer *lexer, struct hlWindow *window) {
+  lexer->scs = E.syntax->singlelineCommentStart;
+  lexer->mcs = E.syntax->multilineCommentStart;
+  lexer->mce = E.syntax->multilineCommentEnd;
+
+  lexer->scsLength = lexer->scs ? strlen(lexer->scs) : 0;
+  lexer->mcsLength = lexer->mcs ? strlen(lexer->mcs) : 0;
+  lexer->mceLength = lexer->mce ? strlen(lexer->mce) : 0;
+
+  lexer->window = window;
+}
+
+void editorLexPaint(erow *row, struct hlLexer *lexer, struct hlCheckpoint *state, int hl, int len) {
+  struct hlWindow *window = lexer->window;
+  int at = state->pos;
+
+  state->pos += len;
+  state->previousHl = hl;
+
+  if (window == NULL) {
+    editorRowSetHl(row, at, hl, len);
+    return;
+  }
+
+  int from = at > window->from ? at : window->from;
+  int to = at + len < window->to ? at + len : window->to;
+
+  if (from < to) {
+    memset(&window->hl[from - window->from], hl, to - from);
+  }
+}
+
+int editorLexStep(erow *row, struct hlLexer *lexer, struct hlCheckpoint *state, int limit) {
+  int i = state->pos;
+  char c = ROW_CHAR(row, i);
+  unsigned char class = E.byteClass[(unsigned char) c];
+
+  if (lexer->scsLength && !state->inString && !state->inComment && (class & HL_CLASS_DELIMITER)) {
+    if (editorRowMatch(row, i, lexer->scs, lexer->scsLength)) {
+      editorLexPaint(row, lexer, state, HL_COMMENT, row->size - i);
+      return 1;
+    }
+  }
+
+  if (lexer->mcsLength && lexer->mceLength && !state->inString) {
+    if (state->inComment) {
+      if (editorRowMatch(row, i, lexer->mce, lexer->mceLength)) {
+        editorLexPaint(row, lexer, state, HL_MLCOMMENT, lexer->mceLength);
+        state->inComment = 0;
+        state->previousSep = 1;
+        return 0;
+      }
+
+      int end = editorRowScan(row, i + 1, limit, lexer->mce[0], lexer->mce[0]);
+      editorLexPaint(row, lexer, state, HL_MLCOMMENT, end - i);
+      return 0;
+    } else if ((class & HL_CLASS_DELIMITER) && editorRowMatch(row, i, lexer->mcs, lexer->mcsLength)) {
+      editorLexPaint(row, lexer, state, HL_MLCOMMENT, lexer->mcsLength);
+      state->inComment = 1;
+      return 0;
+    }
+  }
+
+  if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
+    if (state->inString) {
+      if (c == '\\' && i + 1 < row->size) {
+        editorLexPaint(row, lexer, state, HL_STRING, 2);
+      } else if (c == state->inString) {
+        editorLexPaint(row, lexer, state, HL_STRING, 1);
+        state->inString = 0;
+        state->previousSep = 1;
+      } else {
+        int end = editorRowScan(row, i + 1, limit, state->inString, '\\');
+        editorLexPaint(row, lexer, state, HL_STRING, end - i);
+        state->previousSep = 1;
+      }
+
+      return 0;
+    } else if (class & HL_CLASS_QUOTE) {
+      state->inString = c;
+      editorLexPaint(row, lexer, state, HL_STRING, 1);
+      return 0;
+    }
+  }
+
+  if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
+    if (((class & HL_CLASS_DIGIT) && (state->previousSep || state->previousHl == HL_NORMAL)) || (c == '.' && state->previousHl == HL_NUMBER)) {
+      editorLexPaint(row, lexer, state, HL_NUMBER, 1);
+      state->previousSep = 0;
+      return 0;
+    }
+  }
+
+  if (state->previousSep) {
+    int kLength;
+    int kHl = editorMatchKeyword(row, i, &kLength);
+
+    if (kHl != HL_NORMAL) {
+      editorLexPaint(row, lexer, state, kHl, kLength);
+      state->previousSep = 0;
+      return 0;
+    }
+  }
+
+  editorLexPaint(row, lexer, state, HL_NORMAL, 1);
+  state->previousSep = (class & HL_CLASS_SEPARATOR) != 0;
+
+  return 0;
+}
+
+int editorUpdateSyntaxFrom(erow *row, int at, int delta) {
+  if (E.syntax == NULL) {
+    if (delta > 0 && row->hl) {
+      editorRowSetHl(row, at, HL_NORMAL, delta);
+    }
+
+    return 0;
+  }
+
+  struct hlWindow discard = {NULL, 0, 0};
+  struct hlLexer lexer;
+  editorLexInit(&lexer, row->longLine ? &discard : NULL);
+
+  int lookback = 1 + (lexer.scsLength > lexer.mcsLength ? lexer.scsLength : lexer.mcsLength);
+
+  if (lexer.mceLength >= lookback) {
+    lookback = lexer.mceLength + 1;
+  }
+
+  if (E.keywordMaxLength >= lookback) {
+    lookback = E.keywordMaxLength + 1;
+  }
+
+  struct hlCheckpoint *old = row->hlCheckpoints;
+  int numOld = row->hlNumCheckpoints;
+
+  int kept = 0;
+  while (kept < numOld && old[kept].pos <= at - lookback) {
+    kept++;
+  }
+
+  struct hlCheckpoint state;
+
+  if (kept > 0) {
+    state = old[--kept];
   } else {
-    erow *row = &E.row[E.cursorY];
-    editorInsertRow(E.cursorY + 1, &row->chars[E.cursorX
-], row->size - E.cursorX
-);
-    row = &E.row[E.cursorY];
-    row ->size = E.cursorX
-;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
+    erow *prev = docPrevRow(row);
+    state.pos = 0;
+    state.inString = 0;
+    state.inComment = (prev && prev->hlOpenComment);
+    state.previousSep = 1;
+    state.previousHl = HL_NORMAL;
   }
-  E.cursorY++;
-  E.cursorX = 0;
+
+  int settled = at + (delta > 0 ? delta : 0);
+  int next = kept;
+
+  while (next < numOld && old[next].pos < at - (delta < 0 ? delta : 0)) {
+    next++;
+  }
+
+  int track = row->size > WRITEAM_HL_CHECKPOINT;
+  int numNew = 0;
+  int newCap = 0;
+  struct hlCheckpoint *fresh = NULL;
+  int nextRecord = state.pos;
+  int converged = 0;
+
+  while (state.pos < row->size) {
+    int i = state.pos;
+
+    if (i >= settled) {
+      while (next < numOld && old[next].pos + delta < i) {
+        next++;
+      }
+
+      if (next < numOld && old[next].pos + delta == i && old[next].inString == state.inString && old[next].inComment == state.inComment && old[next].previousSep == state.previousSep && old[next].previousHl == state.previousHl) {
+        converged = 1;
+        break;
+      }
+    }
+
+    if (track && i >= nextRecord) {
+      if (numNew == newCap) {
+        newCap = newCap ? newCap * 2 : 8;
+        fresh = realloc(fresh, sizeof(struct hlCheckpoint) * newCap);
+      }
+
+      fresh[numNew] = state;
+      numNew++;
+      nextRecord = i + WRITEAM_HL_CHECKPOINT;
+    }
+
+    int limit = row->size;
+
+    if (track && nextRecord < limit) {
+      limit = nextRecord;
+    }
+
+    if (next < numOld && old[next].pos + delta > i && old[next].pos + delta < limit) {
+      limit = old[next].pos + delta;
+    }
+
+    if (editorLexStep(row, &lexer, &state, limit)) {
+      break;
+    }
+  }
+
+  if (!converged) {
+    next = numOld;
+  }
+
+  if (track) {
+    int tail = numOld - next;
+    int total = kept + numNew + tail;
+
+    if (total > numOld) {
+      old = realloc(old, sizeof(struct hlCheckpoint) * total);
+    }
+
+    if (tail > 0) {
+      memmove(&old[kept + numNew], &old[next], sizeof(struct hlCheckpoint) * tail);
+    }
+
+    if (numNew > 0) {
+      memcpy(&old[kept], fresh, sizeof(struct hlCheckpoint) * numNew);
+    }
+
+    for (int j = kept + numNew; j < total; j++) {
+      old[j].pos += delta;
+    }
+
+    row->hlCheckpoints = old;
+    row->hlNumCheckpoints = total;
+  } else {
+    free(old);
+    row->hlCheckpoints = NULL;
+    row->hlNumCheckpoints = 0;
+  }
+
+  free(fresh);
+
+  if (converged) {
+    return 0;
+  }
+
+  int changed = (row->hlOpenComment != state.inComment);
+  row->hlOpenComment = state.inComment;
+
+  return changed;
 }
 
-void editorDelChar() {
-  if (E.cursorY == E.numRows) {
+void editorHighlightWindow(erow *row, int from, int to, unsigned char *hl) {
+  if (E.syntax == NULL) {
+    memset(hl, HL_NORMAL, to - from);
+    return;
+  }
+
+  struct hlWindow window = {hl, from, to};
+  struct hlLexer lexer;
+  editorLexInit(&lexer, &window);
+
+  int lo = 0;
+  int hi = row->hlNumCheckpoints;
+
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+
+    if (row->hlCheckpoints[mid].pos <= from) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  struct hlCheckpoint state;
+
+  if (lo > 0) {
+    state = row->hlCheckpoints[lo - 1];
+  } else {
+    erow *prev = docPrevRow(row);
+    state.pos = 0;
+    state.inString = 0;
+    state.inComment = (prev && prev->hlOpenComment);
+    state.previousSep = 1;
+    state.previousHl = HL_NORMAL;
+  }
+
+  while (state.pos < to) {
+    if (editorLexStep(row, &lexer, &state, to)) {
+      break;
+    }
+  }
+}
+
+void editorMarkStale(erow *row) {
+  if (row->hlStale) {
+    return;
+  }
+
+  E.staleRows = realloc(E.staleRows, sizeof(erow *) * (E.numStaleRows + 1));
+  E.staleRows[E.numStaleRows++] = row;
+  row->hlStale = 1;
+}
+
+void editorUnmarkStale(erow *row) {
+  if (!row->hlStale) {
+    return;
+  }
+
+  for (int i = 0; i < E.numStaleRows; i++) {
+    if (E.staleRows[i] == row) {
+      E.staleRows[i] = E.staleRows[--E.numStaleRows];
+      break;
+    }
+  }
+
+  row->hlStale = 0;
+}
+
+int editorRowHighlighted(erow *row) {
+  return row->hl != NULL || row->longLine;
+}
+
+int editorUpdateSyntax(erow *row) {
+  editorUnmarkStale(row);
+
+  int wasOpen = row->hlOpenComment;
+  row->longLine = (row->size >= WRITEAM_LONG_LINE);
+
+  if (row->longLine) {
+    free(row->hl);
+    row->hl = NULL;
+  } else {
+    row->hl = realloc(row->hl, row->size + row->gapLen + 1);
+  }
+
+  free(row->hlCheckpoints);
+  row->hlCheckpoints = NULL;
+  row->hlNumCheckpoints = 0;
+
+  if (E.syntax == NULL) {
+    if (row->hl) {
+      editorRowSetHl(row, 0, HL_NORMAL, row->size);
+    }
+
+    row->hlOpenComment = 0;
+    return wasOpen;
+  }
+
+  editorUpdateSyntaxFrom(row, 0, 0);
+
+  return row->hlOpenComment != wasOpen;
+}
+
+void editorPropagateSyntax(erow *row) {
+  if (row == NULL) {
     return;
   }
 
-  if (E.cursorX
- == 0 && E.cursorY == 0) {
-    return;
+  int limit = E.rowoff + E.screenRows * 2;
+
+  for (int at = docRowIndex(row); row && editorRowHighlighted(row); row = docNextRow(row), at++) {
+    if (at >= limit) {
+      editorMarkStale(row);
+      return;
+    }
+
+    if (!editorUpdateSyntax(row)) {
+      return;
+    }
+  }
+}
+
+void editorResolveStaleRows() {
+  while (E.numStaleRows > 0) {
+    erow *first = NULL;
+    int firstAt = 0;
+
+    for (int i = 0; i < E.numStaleRows; i++) {
+      int at = docRowIndex(E.staleRows[i]);
+
+      if (first == NULL || at < firstAt) {
+        first = E.staleRows[i];
+        firstAt = at;
+      }
+    }
+
+    if (firstAt >= E.rowoff + E.screenRows) {
+      return;
+    }
+
+    editorPropagateSyntax(first);
+  }
+}
+
+int editorHighlightBatch(int *redraw) {
+  int budget = WRITEAM_HL_BATCH;
+
+  while (E.numStaleRows > 0 && budget > 0) {
+    erow *row = E.staleRows[E.numStaleRows - 1];
+    erow *next = docNextRow(row);
+    int at = docRowIndex(row);
+
+    budget -= row->size + 1;
+
+    if (editorUpdateSyntax(row) && next && editorRowHighlighted(next)) {
+      editorMarkStale(next);
+    }
+
+    if (at >= E.rowoff && at < E.rowoff + E.screenRows) {
+      *redraw = 1;
+    }
+  }
+
+  while (E.hlFrontier && budget > 0) {
+    erow *row = E.hlFrontier;
+    E.hlFrontier = docNextRow(row);
+
+    if (editorRowHighlighted(row)) {
+      budget--;
+      continue;
+    }
+
+    budget -= row->size + 1;
+
+    if (editorUpdateSyntax(row) && E.hlFrontier && editorRowHighlighted(E.hlFrontier)) {
+      editorMarkStale(E.hlFrontier);
+    }
+
+    if (!*redraw) {
+      int at = docRowIndex(row);
+      *redraw = (at >= E.rowoff && at < E.rowoff + E.screenRows);
+    }
+  }
+
+  return E.hlFrontier != NULL || E.numStaleRows > 0;
+}
+
+void *editorHighlightWorker(void *arg) {
+  (void) arg;
+
+  pthread_mutex_lock(&E.hlLock);
+
+  while (1) {
+    while (!E.hlIdle || !E.hlPending) {
+      pthread_cond_wait(&E.hlCond, &E.hlLock);
+    }
+
+    E.hlBusy = 1;
+    pthread_mutex_unlock(&E.hlLock);
+
+    int redraw = 0;
+    int pending = editorHighlightBatch(&redraw);
+
+    if (!pending) {
+      pending = editorIndexBatch();
+    }
+
+    pthread_mutex_lock(&E.hlLock);
+    E.hlBusy = 0;
+    E.hlPending = pending;
+
+    if (redraw) {
+      E.hlRedraw = 1;
+    }
+
+    pthread_cond_broadcast(&E.hlCond);
+  }
+
+  return NULL;
+}
+
+void editorReleaseRows() {
+  pthread_mutex_lock(&E.hlLock);
+  E.hlIdle = 1;
+  E.hlPending = E.hlFrontier != NULL || E.numStaleRows > 0 || editorIndexPending();
+  pthread_cond_broadcast(&E.hlCond);
+  pthread_mutex_unlock(&E.hlLock);
+}
+
+int editorAcquireRows() {
+  pthread_mutex_lock(&E.hlLock);
+  E.hlIdle = 0;
+
+  while (E.hlBusy) {
+    pthread_cond_wait(&E.hlCond, &E.hlLock);
+  }
+
+  int redraw = E.hlRedraw;
+  E.hlRedraw = 0;
+  pthread_mutex_unlock(&E.hlLock);
+
+  return redraw;
+}
+
+int editorSyntaxToColor(int hl) {
+  switch (hl) {
+    case HL_COMMENT:
+      return 36;
+    case HL_MLCOMMENT:
+      return 36;
+    case HL_KEYWORD1:
+      return 33;
+    case HL_KEYWORD2:
+      return 32;
+    case HL_STRING:
+      return 35;
+    case HL_NUMBER:
+      return 31;
+    case HL_MATCH:
+      return 34;
+    default:
+      return 37;
+  }
+}
+
+void editorSelectSyntaxHighlight() {
+  E.syntax = NULL;
+
+  if (E.fileName == NULL) {
+    return;
+  }
+
+  char *ext = strrchr(E.fileName, '.');
+
+  for (unsigned int i = 0; i < HLDB_ENTRIES; i++) {
+    struct editorSyntax *s = &HLDB[i];
+    unsigned int j = 0;
+
+    while (s->fileMatch[j]) {
+      int isExt = (s->fileMatch[j][0] == '.');
+
+      if ((isExt && ext && !strcmp(ext, s->fileMatch[j])) || (!isExt && strstr(E.fileName, s->fileMatch[j]))) {
+        E.syntax = s;
+        editorCompileKeywords(s->keywords);
+        editorCompileByteClasses(s);
+
+        for (erow *row = docRowAt(0); row; row = docNextRow(row)) {
+          editorUnmarkStale(row);
+          free(row->hl);
+          free(row->hlCheckpoints);
+          row->hl = NULL;
+          row->hlCheckpoints = NULL;
+          row->hlNumCheckpoints = 0;
+          row->hlOpenComment = 0;
+          row->longLine = 0;
+        }
+
+        E.hlFrontier = docRowAt(0);
+
+        return;
+      }
+
+      j++;
+    }
+  }
+}
+
+/*** Section 9: Row Operations ***/
+
+int editorDecodeUtf8(const unsigned char *s, int len, unsigned int *cp) {
+  unsigned int c = s[0];
+  int length;
+
+  if (c < 0x80) {
+    *cp = c;
+    return 1;
+  } else if (c >= 0xc2 && c <= 0xdf) {
+    length = 2;
+    c &= 0x1f;
+  } else if (c >= 0xe0 && c <= 0xef) {
+    length = 3;
+    c &= 0x0f;
+  } else if (c >= 0xf0 && c <= 0xf4) {
+    length = 4;
+    c &= 0x07;
+  } else {
+    *cp = 0xfffd;
+    return 1;
+  }
+
+  if (len < length) {
+    *cp = 0xfffd;
+    return 1;
+  }
+
+  for (int i = 1; i < length; i++) {
+    if ((s[i] & 0xc0) != 0x80) {
+      *cp = 0xfffd;
+      return 1;
+    }
+
+    c = (c << 6) | (s[i] & 0x3f);
+  }
+
+  if ((length == 3 && c < 0x800) || (length == 4 && (c < 0x10000 || c > 0x10ffff)) || (c >= 0xd800 && c <= 0xdfff)) {
+    *cp = 0xfffd;
+    return 1;
+  }
+
+  *cp = c;
+
+  return length;
+}
+
+int editorEncodeUtf8(unsigned int cp, char *out) {
+  if (cp < 0x80) {
+    out[0] = cp;
+    return 1;
+  } else if (cp < 0x800) {
+    out[0] = 0xc0 | (cp >> 6);
+    out[1] = 0x80 | (cp & 0x3f);
+    return 2;
+  } else if (cp < 0x10000) {
+    out[0] = 0xe0 | (cp >> 12);
+    out[1] = 0x80 | ((cp >> 6) & 0x3f);
+    out[2] = 0x80 | (cp & 0x3f);
+    return 3;
+  }
+
+  out[0] = 0xf0 | (cp >> 18);
+  out[1] = 0x80 | ((cp >> 12) & 0x3f);
+  out[2] = 0x80 | ((cp >> 6) & 0x3f);
+  out[3] = 0x80 | (cp & 0x3f);
+
+  return 4;
+}
+
+int editorCharWidth(unsigned int cp) {
+  static const unsigned int zero[][2] = {
+    {0x0300, 0x036f}, {0x0483, 0x0489}, {0x0591, 0x05bd}, {0x0610, 0x061a}, {0x064b, 0x065f},
+    {0x0e31, 0x0e31}, {0x0e34, 0x0e3a}, {0x1ab0, 0x1aff}, {0x1dc0, 0x1dff}, {0x200b, 0x200f},
+    {0x20d0, 0x20ff}, {0xfe00, 0xfe0f}, {0xfe20, 0xfe2f}, {0xe0100, 0xe01ef}
+  };
+  static const unsigned int wide[][2] = {
+    {0x1100, 0x115f}, {0x231a, 0x231b}, {0x2329, 0x232a}, {0x23e9, 0x23ec}, {0x2e80, 0x303e},
+    {0x3041, 0x33ff}, {0x3400, 0x4dbf}, {0x4e00, 0x9fff}, {0xa000, 0xa4cf}, {0xa960, 0xa97f},
+    {0xac00, 0xd7a3}, {0xf900, 0xfaff}, {0xfe10, 0xfe19}, {0xfe30, 0xfe6f}, {0xff00, 0xff60},
+    {0xffe0, 0xffe6}, {0x1f300, 0x1f64f}, {0x1f900, 0x1f9ff}, {0x20000, 0x2fffd}, {0x30000, 0x3fffd}
+  };
+
+  if (cp < 0x300) {
+    return 1;
+  }
+
+  for (unsigned int i = 0; i < sizeof(zero) / sizeof(zero[0]); i++) {
+    if (cp >= zero[i][0] && cp <= zero[i][1]) {
+      return 0;
+    }
+  }
+
+  for (unsigned int i = 0; i < sizeof(wide) / sizeof(wide[0]); i++) {
+    if (cp >= wide[i][0] && cp <= wide[i][1]) {
+      return 2;
+    }
+  }
+
+  return 1;
+}
+
+int editorRowDecode(erow *row, int at, unsigned int *cp) {
+  unsigned char s[4];
+  int len = row->size - at < 4 ? row->size - at : 4;
+
+  for (int i = 0; i < len; i++) {
+    s[i] = ROW_CHAR(row, at + i);
+  }
+
+  return editorDecodeUtf8(s, len, cp);
+}
+
+int editorRowCharWidth(erow *row, int at, int rx, int *length) {
+  unsigned char c = ROW_CHAR(row, at);
+  *length = 1;
+
+  if (c == '\t') {
+    return WRITEAM_TAB_STOP - (rx % WRITEAM_TAB_STOP);
+  }
+
+  if (c < 0x80) {
+    return 1;
+  }
+
+  unsigned int cp;
+  *length = editorRowDecode(row, at, &cp);
+
+  return editorCharWidth(cp);
+}
+
+int editorRowCharStart(erow *row, int at) {
+  for (int back = 1; back < 4 && at - back >= 0; back++) {
+    unsigned int cp;
+
+    if ((unsigned char) ROW_CHAR(row, at - back) >= 0xc0 && editorRowDecode(row, at - back, &cp) > back) {
+      return at - back;
+    }
+  }
+
+  return at;
+}
+
+int editorRowPrevChar(erow *row, int at) {
+  return at > 0 ? editorRowCharStart(row, at - 1) : 0;
+}
+
+int editorRowNextChar(erow *row, int at) {
+  unsigned int cp;
+
+  return at < row->size ? at + editorRowDecode(row, at, &cp) : at;
+}
+
+struct rxCheckpoint editorRowSeekColumn(erow *row, int cx, int rx) {
+  struct rxCheckpoint best = {0, 0};
+
+  if (row->size < WRITEAM_RX_CHECKPOINT) {
+    return best;
+  }
+
+  int lo = 0;
+  int hi = row->rxNumCheckpoints;
+
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+
+    if (row->rxCheckpoints[mid].cx <= cx && row->rxCheckpoints[mid].rx <= rx) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  if (lo > 0) {
+    best = row->rxCheckpoints[lo - 1];
+  }
+
+  if (lo < row->rxNumCheckpoints) {
+    return best;
+  }
+
+  struct rxCheckpoint at = best;
+  int next = (row->rxNumCheckpoints + 1) * WRITEAM_RX_CHECKPOINT;
+
+  while (at.cx < row->size) {
+    int length;
+    at.rx += editorRowCharWidth(row, at.cx, at.rx, &length);
+    at.cx += length;
+
+    if (at.cx < next) {
+      continue;
+    }
+
+    if (row->rxNumCheckpoints == row->rxCapCheckpoints) {
+      row->rxCapCheckpoints = row->rxCapCheckpoints ? row->rxCapCheckpoints * 2 : 16;
+      row->rxCheckpoints = realloc(row->rxCheckpoints, sizeof(struct rxCheckpoint) * row->rxCapCheckpoints);
+    }
+
+    row->rxCheckpoints[row->rxNumCheckpoints++] = at;
+    next = (row->rxNumCheckpoints + 1) * WRITEAM_RX_CHECKPOINT;
+
+    if (at.cx > cx || at.rx > rx) {
+      break;
+    }
+
+    best = at;
+  }
+
+  return best;
+}
+
+void editorRowInvalidateColumns(erow *row, int at) {
+  while (row->rxNumCheckpoints > 0 && row->rxCheckpoints[row->rxNumCheckpoints - 1].cx + 3 > at) {
+    row->rxNumCheckpoints--;
+  }
+}
+
+int editorRowCxToRx(erow *row, int cx) {
+  struct rxCheckpoint from = editorRowSeekColumn(row, cx, INT_MAX);
+  int rx = from.rx;
+
+  for (int at = from.cx; at < cx;) {
+    int length;
+    rx += editorRowCharWidth(row, at, rx, &length);
+    at += length;
+  }
+
+  return rx;
+}
+
+int editorRowRxToCx(erow *row, int rx) {
+  struct rxCheckpoint from = editorRowSeekColumn(row, INT_MAX, rx);
+  int cur_rx = from.rx;
+  int cx = from.cx;
+
+  while (cx < row->size) {
+    int length;
+    cur_rx += editorRowCharWidth(row, cx, cur_rx, &length);
+
+    if (cur_rx > rx) {
+      return cx;
+    }
+
+    cx += length;
+  }
+
+  return cx;
+}
+
+void editorUpdateRow(erow *row, int at, int delta) {
+  int changed;
+
+  editorRowInvalidateColumns(row, at);
+
+  if (!editorRowHighlighted(row) || (!row->longLine && row->size >= WRITEAM_LONG_LINE)) {
+    changed = editorUpdateSyntax(row);
+  } else {
+    changed = editorUpdateSyntaxFrom(row, at, delta);
+  }
+
+  if (changed) {
+    editorPropagateSyntax(docNextRow(row));
+  }
+
+  editorIndexEdit(row, at, delta);
+}
+
+int editorRowPinned(erow *row) {
+  return E.save && !row->mapped && row->pinned == E.saveGeneration;
+}
+
+void editorRowReleaseChars(erow *row) {
+  struct editorSaveJob *job = E.save;
+
+  if (editorRowPinned(row)) {
+    if (job->numGarbage == job->garbageCap) {
+      job->garbageCap = job->garbageCap ? job->garbageCap * 2 : 64;
+      job->garbage = realloc(job->garbage, sizeof(char *) * job->garbageCap);
+    }
+
+    job->garbage[job->numGarbage++] = row->chars;
+  } else if (!row->mapped) {
+    free(row->chars);
+  }
+
+  row->pinned = 0;
+}
+
+void editorRowOwnChars(erow *row) {
+  if (!row->mapped && !editorRowPinned(row)) {
+    return;
+  }
+
+  char *chars = malloc(row->size + 1);
+  memcpy(chars, row->chars, row->size);
+  chars[row->size] = '\0';
+
+  editorRowReleaseChars(row);
+  row->chars = chars;
+  row->mapped = 0;
+}
+
+void editorRowCloseGap(erow *row) {
+  if (row == NULL || row != E.gapRow) {
+    return;
+  }
+
+  memmove(&row->chars[row->gapAt], &row->chars[row->gapAt + row->gapLen], row->size - row->gapAt);
+  row->chars = realloc(row->chars, row->size + 1);
+  row->chars[row->size] = '\0';
+
+  if (row->hl) {
+    memmove(&row->hl[row->gapAt], &row->hl[row->gapAt + row->gapLen], row->size - row->gapAt);
+    row->hl = realloc(row->hl, row->size + 1);
+  }
+
+  row->gapAt = 0;
+  row->gapLen = 0;
+
+  E.gapRow = NULL;
+}
+
+void editorRowMoveGap(erow *row, int at) {
+  if (row != E.gapRow) {
+    editorRowCloseGap(E.gapRow);
+    E.gapRow = row;
+  }
+
+  if (row->gapLen == 0) {
+    int gapLen = row->size > 16 ? row->size : 16;
+
+    if (gapLen > WRITEAM_LONG_LINE) {
+      gapLen = WRITEAM_LONG_LINE;
+    }
+
+    char *chars = malloc(row->size + gapLen);
+
+    memcpy(chars, row->chars, at);
+    memcpy(&chars[at + gapLen], &row->chars[at], row->size - at);
+
+    editorRowReleaseChars(row);
+    row->chars = chars;
+    row->mapped = 0;
+
+    if (row->hl) {
+      unsigned char *hl = malloc(row->size + gapLen + 1);
+      memcpy(hl, row->hl, at);
+      memcpy(&hl[at + gapLen], &row->hl[at], row->size - at);
+      free(row->hl);
+      row->hl = hl;
+    }
+
+    row->gapAt = at;
+    row->gapLen = gapLen;
+  } else if (at < row->gapAt) {
+    memmove(&row->chars[at + row->gapLen], &row->chars[at], row->gapAt - at);
+
+    if (row->hl) {
+      memmove(&row->hl[at + row->gapLen], &row->hl[at], row->gapAt - at);
+    }
+
+    row->gapAt = at;
+  } else if (at > row->gapAt) {
+    memmove(&row->chars[row->gapAt], &row->chars[row->gapAt + row->gapLen], at - row->gapAt);
+
+    if (row->hl) {
+      memmove(&row->hl[row->gapAt], &row->hl[row->gapAt + row->gapLen], at - row->gapAt);
+    }
+
+    row->gapAt = at;
+  }
+}
+
+void editorInsertRow(int at, char *s, size_t len) {
+  if (at < 0 || at > E.numRows) {
+    return;
+  }
+
+  erow *row = docInsertRow(at);
+
+  row->size = len;
+  row->chars = malloc(len + 1);
+  memcpy(row->chars, s, len);
+  row->chars[len] = '\0';
+
+  erow *prev = docPrevRow(row);
+  row->hlOpenComment = prev ? prev->hlOpenComment : 0;
+
+  if (editorUpdateSyntax(row)) {
+    editorPropagateSyntax(docNextRow(row));
+  }
+
+  editorIndexTouch(row);
+  editorUndoRecord(UNDO_INSERT_ROW, row, 0, row->chars, row->size, 0);
+  E.dirty++;
+}
+
+void editorFreeRow(erow *row) {
+  if (row == E.gapRow) {
+    E.gapRow = NULL;
+  }
+
+  if (row == E.hlFrontier) {
+    E.hlFrontier = docNextRow(row);
+  }
+
+  if (row == E.indexFrontier) {
+    E.indexFrontier = docNextRow(row);
+  }
+
+  editorUnmarkStale(row);
+
+  free(row->hl);
+  free(row->hlCheckpoints);
+  free(row->rxCheckpoints);
+  editorRowReleaseChars(row);
+}
+
+void editorDelRow(int at) {
+  if (at < 0 || at >= E.numRows) {
+    return;
+  }
+
+  erow *row = docRowAt(at);
+  erow *prev = docPrevRow(row);
+  erow *next = docNextRow(row);
+  int changed = row->hlOpenComment != (prev ? prev->hlOpenComment : 0);
+
+  editorRowCloseGap(row);
+  editorUndoRecord(UNDO_DELETE_ROW, row, 0, row->chars, row->size, 0);
+  editorFreeRow(row);
+  docRemoveRow(row);
+
+  if (changed) {
+    editorPropagateSyntax(next);
+  }
+
+  E.dirty++;
+}
+
+void editorRowInsertChar(erow *row, int at, int c) {
+  if (at < 0 || at > row->size) {
+    at = row->size;
+  }
+
+  char ch = c;
+  editorUndoRecord(UNDO_INSERT, row, at, &ch, 1, 1);
+
+  editorRowMoveGap(row, at);
+  row->chars[row->gapAt++] = c;
+  row->gapLen--;
+  row->size++;
+  editorUpdateRow(row, at, 1);
+
+  E.dirty++;
+}
+
+void editorRowAppendString(erow *row, char *s, size_t len) {
+  editorUndoRecord(UNDO_INSERT, row, row->size, s, len, 0);
+  editorRowCloseGap(row);
+  editorRowOwnChars(row);
+  row->chars = realloc(row->chars, row->size + len + 1);
+  memcpy(&row->chars[row->size], s, len);
+
+  if (row->hl) {
+    row->hl = realloc(row->hl, row->size + len + 1);
+  }
+
+  row->size += len;
+  row->chars[row->size] = '\0';
+  editorUpdateRow(row, row->size - len, len);
+  E.dirty++;
+}
+
+void editorRowInsertString(erow *row, int at, const char *s, int len) {
+  if (at < 0 || at > row->size) {
+    at = row->size;
+  }
+
+  editorUndoRecord(UNDO_INSERT, row, at, s, len, 0);
+  editorRowMoveGap(row, at);
+
+  if (row->gapLen < len) {
+    editorRowCloseGap(row);
+    row->chars = realloc(row->chars, row->size + len + 1);
+    memmove(&row->chars[at + len], &row->chars[at], row->size - at + 1);
+
+    if (row->hl) {
+      row->hl = realloc(row->hl, row->size + len + 1);
+      memmove(&row->hl[at + len], &row->hl[at], row->size - at);
+    }
+
+    memcpy(&row->chars[at], s, len);
+  } else {
+    memcpy(&row->chars[row->gapAt], s, len);
+    row->gapAt += len;
+    row->gapLen -= len;
+  }
+
+  row->size += len;
+  editorUpdateRow(row, at, len);
+  E.dirty++;
+}
+
+void editorRowDelChar(erow *row, int at) {
+  if (at < 0 || at >= row->size) {
+    return;
+  }
+
+  char ch = ROW_CHAR(row, at);
+  editorUndoRecord(UNDO_DELETE, row, at, &ch, 1, 1);
+
+  editorRowMoveGap(row, at + 1);
+  row->gapAt--;
+  row->gapLen++;
+  row->size--;
+  editorUpdateRow(row, at, -1);
+  E.dirty++;
+}
+
+void editorRowDeleteRange(erow *row, int at, int len) {
+  if (at < 0 || len <= 0 || at + len > row->size) {
+    return;
+  }
+
+  editorRowMoveGap(row, at + len);
+  editorUndoRecord(UNDO_DELETE, row, at, &row->chars[at], len, 0);
+
+  row->gapAt -= len;
+  row->gapLen += len;
+  row->size -= len;
+  editorUpdateRow(row, at, -len);
+  E.dirty++;
+}
+
+/*** Section 10: Editor Operations ***/
+
+void editorInsertChar(int c) {
+  if (E.cursorY == E.numRows) {
+    editorInsertRow(E.numRows, "", 0);
+  }
+  editorRowInsertChar(docRowAt(E.cursorY), E.cursorX
+, c);
+  E.cursorX++;
+}
+
+void editorInsertNewLine() {
+  if (E.cursorX
+ == 0) {
+    editorInsertRow(E.cursorY, "", 0);
+  } else {
+    erow *row = docRowAt(E.cursorY);
+    editorRowCloseGap(row);
+    editorInsertRow(E.cursorY + 1, &row->chars[E.cursorX
+], row->size - E.cursorX
+);
+    editorRowDeleteRange(row, E.cursorX, row->size - E.cursorX);
+  }
+  E.cursorY++;
+  E.cursorX = 0;
+}
+
+const char *editorFindLineBreak(const char *s, const char *end) {
+  while (s < end && *s != '\r' && *s != '\n') {
+    s++;
+  }
+
+  return s;
+}
+
+const char *editorSkipLineBreak(const char *s, const char *end) {
+  if (s + 1 < end && s[0] == '\r' && s[1] == '\n') {
+    return s + 2;
+  }
+
+  return s + 1;
+}
+
+void editorInsertText(const char *s, size_t len) {
+  if (E.cursorY == E.numRows) {
+    editorInsertRow(E.numRows, "", 0);
+  }
+
+  erow *row = docRowAt(E.cursorY);
+  const char *end = s + len;
+  const char *lineEnd = editorFindLineBreak(s, end);
+
+  if (lineEnd == end) {
+    editorRowInsertString(row, E.cursorX, s, len);
+    E.cursorX += len;
+    return;
+  }
+
+  editorRowCloseGap(row);
+  editorRowOwnChars(row);
+
+  int tailLength = row->size - E.cursorX;
+  char *tail = malloc(tailLength + 1);
+  memcpy(tail, &row->chars[E.cursorX], tailLength);
+
+  int openComment = row->hlOpenComment;
+  int numRows = 0;
+
+  for (const char *p = lineEnd; p < end; p = editorFindLineBreak(editorSkipLineBreak(p, end), end)) {
+    numRows++;
+  }
+
+  erow *rows = malloc(sizeof(erow) * numRows);
+  const char *p = editorSkipLineBreak(lineEnd, end);
+
+  for (int i = 0; i < numRows; i++) {
+    const char *next = editorFindLineBreak(p, end);
+    int lineLength = next - p;
+    int extra = (i == numRows - 1) ? tailLength : 0;
+
+    erow *newRow = &rows[i];
+    docInitNode(newRow);
+    newRow->size = lineLength + extra;
+    newRow->chars = malloc(newRow->size + 1);
+    memcpy(newRow->chars, p, lineLength);
+    memcpy(&newRow->chars[lineLength], tail, extra);
+    newRow->chars[newRow->size] = '\0';
+    newRow->hlOpenComment = openComment;
+
+    if (next < end) {
+      p = editorSkipLineBreak(next, end);
+    }
+  }
+
+  free(tail);
+
+  erow *a, *b;
+  docSplit(E.root, E.cursorY + 1, &a, &b);
+  docSetRoot(docMerge(docMerge(a, docBuild(rows, numRows)), b));
+
+  for (int i = 0; i < numRows; i++) {
+    editorIndexTouch(&rows[i]);
+    editorUndoRecord(UNDO_INSERT_ROW, &rows[i], 0, rows[i].chars, rows[i].size, 0);
+  }
+
+  editorRowDeleteRange(row, E.cursorX, tailLength);
+  editorRowAppendString(row, (char *) s, lineEnd - s);
+
+  if (E.hlFrontier == NULL || docRowIndex(E.hlFrontier) > E.cursorY + 1) {
+    E.hlFrontier = &rows[0];
+  }
+
+  E.cursorY += numRows;
+  E.cursorX = rows[numRows - 1].size - tailLength;
+  E.dirty++;
+}
+
+void editorDelChar() {
+  if (E.cursorY == E.numRows) {
+    return;
+  }
+
+  if (E.cursorX
+ == 0 && E.cursorY == 0) {
+    return;
+  }
+
+  erow *row = docRowAt(E.cursorY);
+
+  if (E.cursorX
+ > 0) {
+    int start = editorRowPrevChar(row, E.cursorX);
+
+    while (E.cursorX > start) {
+      editorRowDelChar(row, E.cursorX - 1);
+      E.cursorX--;
+    }
+  } else {
+    erow *prev = docPrevRow(row);
+    E.cursorX
+ = prev->size;
+    editorRowCloseGap(row);
+    editorRowAppendString(prev, row->chars, row->size);
+    editorDelRow(E.cursorY);
+    E.cursorY--;
+  }
+}
+
+void editorUndoClear() {
+  E.undoHead = 0;
+  E.undoLast = -1;
+  E.undoCurrent = 0;
+  E.undoTail = 0;
+  E.undoRow = NULL;
+}
+
+int editorUndoSize(int at) {
+  struct undoRecord rec;
+  memcpy(&rec, &E.undo[at], sizeof(rec));
+
+  return sizeof(rec) + rec.length;
+}
+
+int editorUndoMakeRoom(int size) {
+  int target = WRITEAM_UNDO_LIMIT - WRITEAM_UNDO_LIMIT / 4;
+
+  while (E.undoHead < E.undoTail && E.undoTail - E.undoHead + size > target) {
+    struct undoRecord rec;
+    memcpy(&rec, &E.undo[E.undoHead], sizeof(rec));
+
+    if (rec.group == E.undoGroup) {
+      return 0;
+    }
+
+    int group = rec.group;
+
+    while (E.undoHead < E.undoTail && rec.group == group) {
+      E.undoHead += sizeof(rec) + rec.length;
+
+      if (E.undoHead < E.undoTail) {
+        memcpy(&rec, &E.undo[E.undoHead], sizeof(rec));
+      }
+    }
+  }
+
+  if (E.undoHead == E.undoTail) {
+    editorUndoClear();
+    return 1;
+  }
+
+  memmove(E.undo, &E.undo[E.undoHead], E.undoTail - E.undoHead);
+  E.undoLast -= E.undoHead;
+  E.undoCurrent -= E.undoHead;
+  E.undoTail -= E.undoHead;
+  E.undoHead = 0;
+
+  return 1;
+}
+
+int editorUndoExtend(int type, erow *row, int col, char c) {
+  if (E.undoLast < 0 || E.undoCurrent != E.undoTail || row != E.undoRow || E.undoTail == WRITEAM_UNDO_LIMIT) {
+    return 0;
+  }
+
+  struct undoRecord rec;
+  memcpy(&rec, &E.undo[E.undoLast], sizeof(rec));
+
+  if (!rec.run || rec.group < E.undoGroup - 1) {
+    return 0;
+  }
+
+  if (type == UNDO_INSERT && rec.type == UNDO_INSERT && col == rec.col + rec.length) {
+  } else if (type == UNDO_DELETE && rec.type == UNDO_DELETE && col == rec.col) {
+  } else if (type == UNDO_DELETE && (rec.type == UNDO_ERASE || (rec.type == UNDO_DELETE && rec.length == 1)) && col == rec.col - 1) {
+    rec.type = UNDO_ERASE;
+    rec.col--;
+  } else {
+    return 0;
+  }
+
+  E.undo[E.undoTail++] = c;
+  E.undoCurrent = E.undoTail;
+  rec.length++;
+  rec.group = E.undoGroup;
+  memcpy(&E.undo[E.undoLast], &rec, sizeof(rec));
+
+  return 1;
+}
+
+void editorUndoRecord(int type, erow *row, int col, const char *text, int length, int run) {
+  int at = docRowIndex(row);
+  editorJournalRecord(type, at, col, text, length);
+
+  if (E.undoReplaying || E.undoGroup == E.undoDropGroup) {
+    return;
+  }
+
+  if (run && editorUndoExtend(type, row, col, text[0])) {
+    return;
+  }
+
+  int size = sizeof(struct undoRecord) + length;
+  E.undoTail = E.undoCurrent;
+
+  if (E.undo == NULL) {
+    E.undo = malloc(WRITEAM_UNDO_LIMIT);
+  }
+
+  if (E.undoTail + size > WRITEAM_UNDO_LIMIT && (size > WRITEAM_UNDO_LIMIT || !editorUndoMakeRoom(size))) {
+    editorUndoClear();
+    E.undoDropGroup = E.undoGroup;
+    return;
+  }
+
+  struct undoRecord rec;
+  rec.type = type;
+  rec.group = E.undoGroup;
+  rec.run = run;
+  rec.row = at;
+  rec.col = col;
+  rec.length = length;
+  rec.previous = E.undoLast >= 0 ? E.undoTail - E.undoLast : 0;
+  rec.cursorX = E.undoCursorX;
+  rec.cursorY = E.undoCursorY;
+
+  memcpy(&E.undo[E.undoTail], &rec, sizeof(rec));
+  memcpy(&E.undo[E.undoTail + sizeof(rec)], text, length);
+
+  E.undoLast = E.undoTail;
+  E.undoTail += size;
+  E.undoCurrent = E.undoTail;
+  E.undoRow = row;
+}
+
+void editorUndoApply(struct undoRecord *rec, char *text, int undo) {
+  erow *row = docRowAt(rec->row);
+
+  switch (rec->type) {
+    case UNDO_INSERT:
+    case UNDO_DELETE:
+    case UNDO_ERASE:
+      if (undo == (rec->type == UNDO_INSERT)) {
+        editorRowDeleteRange(row, rec->col, rec->length);
+      } else if (rec->type == UNDO_ERASE) {
+        char *forward = malloc(rec->length);
+
+        for (int i = 0; i < rec->length; i++) {
+          forward[i] = text[rec->length - 1 - i];
+        }
+
+        editorRowInsertString(row, rec->col, forward, rec->length);
+        free(forward);
+      } else {
+        editorRowInsertString(row, rec->col, text, rec->length);
+      }
+      break;
+    case UNDO_INSERT_ROW:
+    case UNDO_DELETE_ROW:
+      if (undo == (rec->type == UNDO_INSERT_ROW)) {
+        editorDelRow(rec->row);
+      } else {
+        editorInsertRow(rec->row, text, rec->length);
+      }
+      break;
+  }
+}
+
+void editorUndo() {
+  if (E.undoLast < 0) {
+    editorSetStatusMessage("Nothing to undo");
+    return;
+  }
+
+  struct undoRecord rec;
+  memcpy(&rec, &E.undo[E.undoLast], sizeof(rec));
+  int group = rec.group;
+
+  E.undoReplaying = 1;
+
+  while (E.undoLast >= 0 && rec.group == group) {
+    editorUndoApply(&rec, &E.undo[E.undoLast + sizeof(rec)], 1);
+
+    E.cursorX = rec.cursorX;
+    E.cursorY = rec.cursorY;
+    E.undoCurrent = E.undoLast;
+    E.undoLast = E.undoLast == E.undoHead ? -1 : E.undoLast - rec.previous;
+
+    if (E.undoLast >= 0) {
+      memcpy(&rec, &E.undo[E.undoLast], sizeof(rec));
+    }
+  }
+
+  if (E.cursorY > E.numRows) {
+    E.cursorY = E.numRows;
+  }
+
+  erow *row = docRowAt(E.cursorY);
+  int rowLength = row ? row->size : 0;
+
+  if (E.cursorX > rowLength) {
+    E.cursorX = rowLength;
+  }
+
+  E.undoReplaying = 0;
+  E.undoRow = NULL;
+}
+
+void editorRedo() {
+  if (E.undoCurrent == E.undoTail) {
+    editorSetStatusMessage("Nothing to redo");
+    return;
+  }
+
+  struct undoRecord rec;
+  memcpy(&rec, &E.undo[E.undoCurrent], sizeof(rec));
+  int group = rec.group;
+
+  E.undoReplaying = 1;
+
+  while (E.undoCurrent < E.undoTail && rec.group == group) {
+    editorUndoApply(&rec, &E.undo[E.undoCurrent + sizeof(rec)], 0);
+
+    E.cursorY = rec.row;
+    E.cursorX = rec.type == UNDO_INSERT ? rec.col + rec.length : rec.col;
+    E.undoLast = E.undoCurrent;
+    E.undoCurrent += editorUndoSize(E.undoCurrent);
+
+    if (E.undoCurrent < E.undoTail) {
+      memcpy(&rec, &E.undo[E.undoCurrent], sizeof(rec));
+    }
+  }
+
+  E.undoReplaying = 0;
+  E.undoRow = NULL;
+}
+
+/*** Section 11: File I/O ***/
+
+int editorWriteAll(int fd, struct iovec *iov, int count) {
+  while (count > 0) {
+    ssize_t written = writev(fd, iov, count);
+
+    if (written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      return -1;
+    }
+
+    while (count > 0 && (size_t) written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov++;
+      count--;
+    }
+
+    if (count > 0) {
+      iov->iov_base = (char *) iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+
+  return 0;
+}
+
+int editorWriteRows(int fd, struct editorSaveJob *job) {
+  static char newline = '\n';
+  struct iovec iov[WRITEAM_SAVE_IOV];
+  int count = 0;
+  long long batch = 0;
+
+  for (int i = 0; i < job->numRows; i++) {
+    if (job->rows[i].iov_len > 0) {
+      iov[count++] = job->rows[i];
+    }
+
+    iov[count].iov_base = &newline;
+    iov[count].iov_len = 1;
+    count++;
+
+    batch += job->rows[i].iov_len + 1;
+
+    if (count > WRITEAM_SAVE_IOV - 2 || i == job->numRows - 1) {
+      if (editorWriteAll(fd, iov, count) == -1) {
+        return -1;
+      }
+
+      pthread_mutex_lock(&job->lock);
+      job->written += batch;
+      pthread_mutex_unlock(&job->lock);
+
+      count = 0;
+      batch = 0;
+    }
+  }
+
+  return 0;
+}
+
+void *editorSaveWorker(void *arg) {
+  struct editorSaveJob *job = arg;
+  int error = 0;
+  int fd = mkstemp(job->tempName);
+
+  if (fd == -1 || fchmod(fd, job->mode) == -1 || editorWriteRows(fd, job) == -1 || fsync(fd) == -1) {
+    error = errno;
+  }
+
+  if (fd != -1 && close(fd) == -1 && !error) {
+    error = errno;
+  }
+
+  if (!error && rename(job->tempName, job->target) == -1) {
+    error = errno;
+  }
+
+  if (error) {
+    if (fd != -1) {
+      unlink(job->tempName);
+    }
+  } else {
+    char *slash = strrchr(job->target, '/');
+
+    if (slash) {
+      slash[slash == job->target] = '\0';
+    }
+
+    int dirFd = open(slash ? job->target : ".", O_RDONLY);
+
+    if (dirFd != -1) {
+      fsync(dirFd);
+      close(dirFd);
+    }
+  }
+
+  pthread_mutex_lock(&job->lock);
+  job->error = error;
+  job->done = 1;
+  pthread_mutex_unlock(&job->lock);
+
+  return NULL;
+}
+
+int editorMapFile(int fd) {
+  struct stat st;
+
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+    return -1;
+  }
+
+  char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+  if (map == MAP_FAILED) {
+    return -1;
+  }
+
+  char *end = map + st.st_size;
+  int lines = 0;
+
+  for (char *p = map; p < end; lines++) {
+    char *newline = memchr(p, '\n', end - p);
+    p = newline ? newline + 1 : end;
+  }
+
+  erow *rows = malloc(sizeof(erow) * lines);
+  int numRows = 0;
+
+  for (char *p = map; p < end;) {
+    char *newline = memchr(p, '\n', end - p);
+    size_t lineLength = (newline ? newline : end) - p;
+
+    while (lineLength > 0 && p[lineLength - 1] == '\r') {
+      lineLength--;
+    }
+
+    erow *row = &rows[numRows++];
+    docInitNode(row);
+    row->size = lineLength;
+    row->chars = p;
+    row->mapped = 1;
+
+    p = newline ? newline + 1 : end;
+  }
+
+  docAppendRows(rows, numRows);
+
+  E.map = map;
+  E.mapSize = st.st_size;
+
+  return 0;
+}
+
+void editorJournalHeader(const char *fileName, struct journalHeader *header) {
+  struct stat st;
+
+  memset(header, 0, sizeof(*header));
+  memcpy(header->magic, "WAMJRNL", 8);
+
+  if (stat(fileName, &st) == -1) {
+    header->size = -1;
+    return;
+  }
+
+  header->inode = st.st_ino;
+  header->size = st.st_size;
+  header->mtime = st.st_mtime;
+
+  if (E.followFile != -1) {
+    header->size = E.followOffset;
+    header->follow = 1;
+  }
+}
+
+int editorJournalCurrent(struct journalHeader *header, struct journalHeader *expected) {
+  if (memcmp(header->magic, expected->magic, sizeof(header->magic)) != 0 || header->inode != expected->inode) {
+    return 0;
+  }
+
+  if (header->follow) {
+    return expected->size >= header->size;
+  }
+
+  return header->size == expected->size && header->mtime == expected->mtime;
+}
+
+char *editorJournalPath(const char *fileName) {
+  const char *base = strrchr(fileName, '/');
+  base = base ? base + 1 : fileName;
+
+  char *path = malloc(strlen(fileName) + 6);
+  int dirLength = base - fileName;
+
+  memcpy(path, fileName, dirLength);
+  sprintf(&path[dirLength], ".%s.swp", base);
+
+  return path;
+}
+
+int editorJournalCreate(const char *path, const char *data, int len) {
+  struct journalHeader header;
+  editorJournalHeader(E.fileName, &header);
+
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0600);
+
+  if (fd == -1) {
+    return -1;
+  }
+
+  struct iovec iov[2] = {{&header, sizeof(header)}, {(char *) data, len}};
+
+  if (editorWriteAll(fd, iov, 2) == -1) {
+    close(fd);
+    unlink(path);
+    return -1;
+  }
+
+  return fd;
+}
+
+void editorJournalRecord(int type, int row, int col, const char *text, int length) {
+  if (E.journalReplaying || E.journalKept || E.fileName == NULL) {
+    return;
+  }
+
+  if (E.journalFd == -1) {
+    free(E.journalName);
+    E.journalName = editorJournalPath(E.fileName);
+    E.journalFd = editorJournalCreate(E.journalName, NULL, 0);
+
+    if (E.journalFd == -1) {
+      return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &E.journalFlushed);
+  }
+
+  int size = sizeof(struct journalRecord) + length;
+
+  if (E.journalLen + size > E.journalCap) {
+    E.journalCap = E.journalCap ? E.journalCap : 4096;
+
+    while (E.journalLen + size > E.journalCap) {
+      E.journalCap *= 2;
+    }
+
+    E.journal = realloc(E.journal, E.journalCap);
+  }
+
+  struct journalRecord rec = {type, row, col, length};
+  memcpy(&E.journal[E.journalLen], &rec, sizeof(rec));
+  memcpy(&E.journal[E.journalLen + sizeof(rec)], text, length);
+  E.journalLen += size;
+
+  if (E.journalLen >= WRITEAM_JOURNAL_BATCH) {
+    struct iovec iov = {E.journal, E.journalLen};
+    editorWriteAll(E.journalFd, &iov, 1);
+    E.journalLen = 0;
+  }
+}
+
+void editorJournalFlush(int force) {
+  if (E.journalFd == -1) {
+    return;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  long elapsed = (now.tv_sec - E.journalFlushed.tv_sec) * 1000 + (now.tv_nsec - E.journalFlushed.tv_nsec) / 1000000;
+
+  if (!force && (E.journalLen == 0 || elapsed < WRITEAM_JOURNAL_INTERVAL)) {
+    return;
+  }
+
+  struct iovec iov = {E.journal, E.journalLen};
+
+  if (editorWriteAll(E.journalFd, &iov, 1) == -1 || fdatasync(E.journalFd) == -1) {
+    editorSetStatusMessage("Swap file error: %s", strerror(errno));
+  }
+
+  E.journalLen = 0;
+  E.journalFlushed = now;
+}
+
+void editorJournalDiscard() {
+  if (E.journalFd == -1) {
+    return;
+  }
+
+  close(E.journalFd);
+  unlink(E.journalName);
+  E.journalFd = -1;
+  E.journalLen = 0;
+}
+
+void editorJournalRebase(off_t from) {
+  editorJournalFlush(1);
+
+  off_t end = lseek(E.journalFd, 0, SEEK_END);
+  int len = end - from;
+  char *tail = malloc(len ? len : 1);
+
+  if (pread(E.journalFd, tail, len, from) == len) {
+    char *tempName = malloc(strlen(E.journalName) + 8);
+    sprintf(tempName, "%s.XXXXXX", E.journalName);
+    int fd = mkstemp(tempName);
+
+    if (fd != -1) {
+      close(fd);
+      fd = editorJournalCreate(tempName, tail, len);
+    }
+
+    if (fd != -1 && fdatasync(fd) == 0 && rename(tempName, E.journalName) == 0) {
+      close(E.journalFd);
+      E.journalFd = fd;
+    } else if (fd != -1) {
+      close(fd);
+      unlink(tempName);
+    }
+
+    free(tempName);
+  }
+
+  free(tail);
+}
+
+off_t editorJournalReplay(int fd) {
+  off_t end = lseek(fd, 0, SEEK_END);
+  off_t at = sizeof(struct journalHeader);
+  int replayed = 0;
+  char *text = NULL;
+
+  E.journalReplaying = 1;
+
+  while (at + (off_t) sizeof(struct journalRecord) <= end) {
+    struct journalRecord rec;
+
+    if (pread(fd, &rec, sizeof(rec), at) != sizeof(rec) || rec.length < 0 || rec.type < UNDO_INSERT ||
+        rec.type > UNDO_DELETE_ROW || at + (off_t) sizeof(rec) + rec.length > end) {
+      break;
+    }
+
+    text = realloc(text, rec.length ? rec.length : 1);
+
+    if (pread(fd, text, rec.length, at + sizeof(rec)) != rec.length) {
+      break;
+    }
+
+    struct undoRecord step = {rec.type, 0, 0, rec.row, rec.col, rec.length, 0, 0, 0};
+
+    if (rec.row >= 0 && rec.row <= E.numRows) {
+      if (rec.row == E.numRows && rec.type != UNDO_INSERT_ROW) {
+        break;
+      }
+
+      editorUndoApply(&step, text, 0);
+    }
+
+    at += sizeof(rec) + rec.length;
+    replayed++;
+  }
+
+  E.journalReplaying = 0;
+  free(text);
+
+  editorSetStatusMessage("Recovered %d edits from %s", replayed, E.journalName);
+
+  return at;
+}
+
+void editorJournalOpen() {
+  E.journalName = editorJournalPath(E.fileName);
+
+  int fd = open(E.journalName, O_RDWR | O_APPEND);
+  struct stat st;
+
+  if (fd == -1) {
+    return;
+  }
+
+  if (fstat(fd, &st) == -1 || st.st_size <= (off_t) sizeof(struct journalHeader)) {
+    close(fd);
+    unlink(E.journalName);
+    return;
+  }
+
+  struct journalHeader header, expected;
+  editorJournalHeader(E.fileName, &expected);
+  int current = pread(fd, &header, sizeof(header), 0) == sizeof(header) && editorJournalCurrent(&header, &expected);
+
+  if (current) {
+    editorSetStatusMessage("Found swap file %s. Recover unsaved changes? (y/n)", E.journalName);
+  } else {
+    editorSetStatusMessage("Stale swap file (y = recover, n = keep, d = delete): %s", E.journalName);
+  }
+
+  editorRefreshScreen();
+
+  int c = editorReadKey();
+  off_t end = -1;
+
+  if (c == 'y' || c == 'Y') {
+    end = editorJournalReplay(fd);
+  } else if (!current && c != 'd' && c != 'D') {
+    close(fd);
+    E.journalKept = 1;
+    editorSetStatusMessage("Kept swap file %s; edits are not journaled", E.journalName);
+    return;
+  } else {
+    editorSetStatusMessage("");
+  }
+
+  if (end > 0 && ftruncate(fd, end) == 0) {
+    E.journalFd = fd;
+    clock_gettime(CLOCK_MONOTONIC, &E.journalFlushed);
+
+    if (!current) {
+      editorJournalRebase(sizeof(struct journalHeader));
+    }
+  } else {
+    close(fd);
+    unlink(E.journalName);
+  }
+}
+
+void editorOpen(char *fileName) {
+  free(E.fileName);
+  E.fileName = strdup(fileName);
+
+  editorSelectSyntaxHighlight();
+
+  FILE *fp = fopen(fileName, "r");
+  if (!fp) {
+    die("fopen");
+  }
+
+  if (editorMapFile(fileno(fp)) == -1) {
+    char *line = NULL;
+    size_t lineCap = 0;
+    ssize_t lineLength;
+
+    while ((lineLength = getline(&line, &lineCap, fp)) != -1) {
+      while (lineLength > 0 && (line[lineLength - 1] == '\n' || line[lineLength - 1] == '\r')) {
+        lineLength--;
+      }
+
+      erow *row = docInsertRow(E.numRows);
+      row->size = lineLength;
+      row->chars = malloc(lineLength + 1);
+      memcpy(row->chars, line, lineLength);
+      row->chars[lineLength] = '\0';
+    }
+
+    free(line);
+  }
+
+  E.hlFrontier = docRowAt(0);
+
+  if (E.mapSize >= WRITEAM_INDEX_MIN_SIZE) {
+    E.index = calloc(1 << WRITEAM_INDEX_BITS, sizeof(struct editorPosting));
+    E.indexFrontier = docRowAt(0);
+  }
+
+  fclose(fp);
+  E.dirty = 0;
+}
+
+void editorStreamPublish(struct editorStream *stream, char *start, size_t len) {
+  pthread_mutex_lock(&stream->lock);
+
+  if (stream->numSlices == stream->sliceCap) {
+    stream->sliceCap = stream->sliceCap ? stream->sliceCap * 2 : 64;
+    stream->slices = realloc(stream->slices, sizeof(struct iovec) * stream->sliceCap);
+  }
+
+  stream->slices[stream->numSlices].iov_base = start;
+  stream->slices[stream->numSlices].iov_len = len;
+  stream->numSlices++;
+  stream->bytes += len;
+
+  pthread_mutex_unlock(&stream->lock);
+}
+
+void *editorStreamReader(void *arg) {
+  struct editorStream *stream = arg;
+  size_t cap = WRITEAM_STREAM_CHUNK;
+  char *buf = malloc(cap);
+  size_t start = 0;
+  size_t len = 0;
+
+  while (1) {
+    if (len == cap) {
+      size_t carry = len - start;
+      cap = carry * 2 > WRITEAM_STREAM_CHUNK ? carry * 2 : WRITEAM_STREAM_CHUNK;
+      char *next = malloc(cap);
+      memcpy(next, &buf[start], carry);
+
+      if (start == 0) {
+        free(buf);
+      }
+
+      buf = next;
+      start = 0;
+      len = carry;
+    }
+
+    ssize_t n = read(stream->fd, &buf[len], cap - len);
+
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+
+    if (n <= 0) {
+      break;
+    }
+
+    len += n;
+
+    char *newline = memrchr(&buf[start], '\n', len - start);
+
+    if (newline) {
+      size_t end = newline + 1 - buf;
+      editorStreamPublish(stream, &buf[start], end - start);
+      start = end;
+    }
+  }
+
+  if (len > start) {
+    editorStreamPublish(stream, &buf[start], len - start);
+  } else if (start == 0) {
+    free(buf);
+  }
+
+  pthread_mutex_lock(&stream->lock);
+  stream->done = 1;
+  pthread_mutex_unlock(&stream->lock);
+
+  return NULL;
+}
+
+void editorStreamAppend(char *start, size_t len) {
+  char *end = start + len;
+  int lines = 0;
+
+  for (char *p = start; p < end; lines++) {
+    char *newline = memchr(p, '\n', end - p);
+    p = newline ? newline + 1 : end;
+  }
+
+  erow *rows = malloc(sizeof(erow) * lines);
+  int numRows = 0;
+
+  for (char *p = start; p < end;) {
+    char *newline = memchr(p, '\n', end - p);
+    size_t lineLength = (newline ? newline : end) - p;
+
+    while (lineLength > 0 && p[lineLength - 1] == '\r') {
+      lineLength--;
+    }
+
+    erow *row = &rows[numRows++];
+    docInitNode(row);
+    row->size = lineLength;
+    row->chars = p;
+    row->mapped = 1;
+
+    p = newline ? newline + 1 : end;
+  }
+
+  docAppendRows(rows, numRows);
+
+  if (E.hlFrontier == NULL) {
+    E.hlFrontier = &rows[0];
+  }
+
+  if (E.index && E.indexFrontier == NULL) {
+    E.indexFrontier = &rows[0];
+  }
+}
+
+int editorStreamPoll() {
+  struct editorStream *stream = E.stream;
+
+  if (stream == NULL) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&stream->lock);
+  struct iovec *slices = stream->slices;
+  int numSlices = stream->numSlices;
+  int done = stream->done;
+  stream->slices = NULL;
+  stream->numSlices = 0;
+  stream->sliceCap = 0;
+  pthread_mutex_unlock(&stream->lock);
+
+  for (int i = 0; i < numSlices; i++) {
+    editorStreamAppend(slices[i].iov_base, slices[i].iov_len);
+  }
+
+  free(slices);
+
+  if (done) {
+    pthread_join(stream->thread, NULL);
+    pthread_mutex_destroy(&stream->lock);
+    close(stream->fd);
+    free(stream);
+    E.stream = NULL;
+  }
+
+  return numSlices > 0 || done;
+}
+
+void editorFollowStart() {
+  int initial = (E.followFile == -1);
+
+  if (E.followFile != -1) {
+    close(E.followFile);
+  }
+
+  struct stat st;
+  E.followFile = open(E.fileName, O_RDONLY);
+
+  if (E.followFile == -1 || fstat(E.followFile, &st) == -1) {
+    editorSetStatusMessage("Cannot follow %s: %s", E.fileName, strerror(errno));
+    return;
+  }
+
+  E.followOffset = st.st_size;
+
+  if (initial && E.map) {
+    char *copy = malloc(E.mapSize);
+    memcpy(copy, E.map, E.mapSize);
+
+    for (erow *row = docRowAt(0); row; row = docNextRow(row)) {
+      if (row->mapped && row->chars >= E.map && row->chars <= E.map + E.mapSize) {
+        row->chars = copy + (row->chars - E.map);
+      }
+    }
+
+    munmap(E.map, E.mapSize);
+    E.map = copy;
+  }
+
+  if (initial) {
+    E.followOffset = E.mapSize;
+
+    if (E.mapSize > 0 && E.map[E.mapSize - 1] != '\n' && E.numRows > 0) {
+      char *newline = memrchr(E.map, '\n', E.mapSize);
+      erow *row = docRowAt(E.numRows - 1);
+
+      E.followOffset = newline ? newline + 1 - E.map : 0;
+      editorFreeRow(row);
+      docRemoveRow(row);
+    }
+  }
+
+#ifdef __linux__
+  if (E.followFd == -1) {
+    E.followFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  }
+
+  if (E.followWatch != -1) {
+    inotify_rm_watch(E.followFd, E.followWatch);
+  }
+
+  E.followWatch = inotify_add_watch(E.followFd, E.fileName, IN_MODIFY);
+#endif
+}
+
+int editorFollowPoll() {
+  if (E.followFile == -1) {
+    return 0;
+  }
+
+#ifdef __linux__
+  if (E.followWatch != -1) {
+    char events[4096];
+    int changed = 0;
+
+    while (read(E.followFd, events, sizeof(events)) > 0) {
+      changed = 1;
+    }
+
+    if (!changed) {
+      return 0;
+    }
+  }
+#endif
+
+  struct stat st;
+
+  if (fstat(E.followFile, &st) == -1 || st.st_size == E.followOffset) {
+    return 0;
+  }
+
+  if (st.st_size < E.followOffset) {
+    E.followOffset = st.st_size;
+    editorSetStatusMessage("%.20s was truncated; kept loaded lines, following new data", E.fileName);
+    return 1;
+  }
+
+  size_t len = st.st_size - E.followOffset;
+  char *buf = malloc(len);
+  ssize_t n = pread(E.followFile, buf, len, E.followOffset);
+  char *newline = n > 0 ? memrchr(buf, '\n', n) : NULL;
+
+  if (newline == NULL) {
+    free(buf);
+    return 0;
+  }
+
+  int pinned = E.cursorY >= E.numRows - 1;
+  int fromEnd = E.numRows - E.cursorY;
+
+  editorStreamAppend(buf, newline + 1 - buf);
+  E.followOffset += newline + 1 - buf;
+
+  if (pinned) {
+    E.cursorY = E.numRows - fromEnd;
+    E.cursorX = 0;
+  }
+
+  return 1;
+}
+
+int editorTakeStdin() {
+  int fd = dup(STDIN_FILENO);
+  int tty = open("/dev/tty", O_RDWR);
+
+  if (fd == -1 || tty == -1 || dup2(tty, STDIN_FILENO) == -1) {
+    die("/dev/tty");
+  }
+
+  close(tty);
+
+  return fd;
+}
+
+void editorOpenStream(int fd) {
+  struct editorStream *stream = calloc(1, sizeof(struct editorStream));
+  stream->fd = fd;
+  pthread_mutex_init(&stream->lock, NULL);
+
+  if (pthread_create(&stream->thread, NULL, editorStreamReader, stream) != 0) {
+    die("pthread_create");
+  }
+
+  E.stream = stream;
+  E.dirty = 0;
+}
+
+void editorSave() {
+  if (E.save) {
+    editorSetStatusMessage("Save already in progress");
+    return;
+  }
+
+  if (E.fileName == NULL) {
+    E.fileName = editorPrompt("Save As: %s (ESC to cancel)", NULL, 0);
+    if (E.fileName == NULL) {
+      editorSetStatusMessage("Save Aborted");
+      return;
+    }
+
+    editorSelectSyntaxHighlight();
+  }
+
+  struct editorSaveJob *job = calloc(1, sizeof(struct editorSaveJob));
+  clock_gettime(CLOCK_MONOTONIC, &job->started);
+
+  job->target = realpath(E.fileName, NULL);
+
+  if (job->target == NULL) {
+    job->target = strdup(E.fileName);
+  }
+
+  struct stat st;
+
+  if (stat(job->target, &st) == 0) {
+    job->mode = st.st_mode & 07777;
+  } else {
+    job->mode = umask(0);
+    umask(job->mode);
+    job->mode = 0666 & ~job->mode;
+  }
+
+  job->tempName = malloc(strlen(job->target) + 8);
+  sprintf(job->tempName, "%s.XXXXXX", job->target);
+
+  editorRowCloseGap(E.gapRow);
+  E.saveGeneration++;
+
+  job->rows = malloc(sizeof(struct iovec) * (E.numRows ? E.numRows : 1));
+
+  for (erow *row = docRowAt(0); row; row = docNextRow(row)) {
+    job->rows[job->numRows].iov_base = row->chars;
+    job->rows[job->numRows].iov_len = row->size;
+    job->numRows++;
+    job->total += row->size + 1;
+    row->pinned = E.saveGeneration;
+  }
+
+  job->dirty = E.dirty;
+  job->journalOffset = sizeof(struct journalHeader);
+
+  if (E.journalFd != -1) {
+    editorJournalFlush(1);
+    job->journalOffset = lseek(E.journalFd, 0, SEEK_END);
+  }
+
+  pthread_mutex_init(&job->lock, NULL);
+
+  if (pthread_create(&job->thread, NULL, editorSaveWorker, job) != 0) {
+    die("pthread_create");
+  }
+
+  E.save = job;
+  E.saveProgress = -1;
+  editorSavePoll();
+}
+
+int editorSavePoll() {
+  struct editorSaveJob *job = E.save;
+
+  if (job == NULL) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&job->lock);
+  int done = job->done;
+  long long written = job->written;
+  pthread_mutex_unlock(&job->lock);
+
+  if (!done) {
+    int progress = job->total ? written * 100 / job->total : 0;
+
+    if (progress == E.saveProgress) {
+      return 0;
+    }
+
+    E.saveProgress = progress;
+    editorSetStatusMessage("Saving... %d%% (%lld of %lld bytes)", progress, written, job->total);
+    return 1;
+  }
+
+  pthread_join(job->thread, NULL);
+
+  if (job->error) {
+    editorSetStatusMessage("Save Failed! I/O Error: %s", strerror(job->error));
+  } else {
+    struct timespec finished;
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    double seconds = (finished.tv_sec - job->started.tv_sec) + (finished.tv_nsec - job->started.tv_nsec) / 1e9;
+
+    if (E.followFile != -1) {
+      editorFollowStart();
+    }
+
+    if (E.dirty == job->dirty) {
+      E.dirty = 0;
+      editorJournalDiscard();
+    } else if (E.journalFd != -1) {
+      editorJournalRebase(job->journalOffset);
+    }
+
+    editorSetStatusMessage("%lld bytes written to disk (%.1f MB/s)", job->total,
+                           seconds > 0 ? job->total / seconds / (1 << 20) : 0.0);
+  }
+
+  for (int i = 0; i < job->numGarbage; i++) {
+    free(job->garbage[i]);
+  }
+
+  pthread_mutex_destroy(&job->lock);
+  free(job->garbage);
+  free(job->rows);
+  free(job->tempName);
+  free(job->target);
+  free(job);
+  E.save = NULL;
+
+  return 1;
+}
+
+void editorSaveWait() {
+  while (E.save) {
+    editorSavePoll();
+
+    if (E.save) {
+      usleep(10000);
+    }
+  }
+}
+
+/*** Section 12: Regular Expressions ***/
+
+void regexSetAdd(unsigned char *set, int c) {
+  set[c >> 3] |= 1 << (c & 7);
+}
+
+int regexSetHas(const unsigned char *set, int c) {
+  return set[c >> 3] & (1 << (c & 7));
+}
+
+void regexSetInvert(unsigned char *set) {
+  for (int i = 0; i < 32; i++) {
+    set[i] = ~set[i];
+  }
+}
+
+void regexSetEscape(unsigned char *set, int c) {
+  unsigned char escape[32];
+  memset(escape, 0, sizeof(escape));
+
+  for (int i = 0; i < 256; i++) {
+    switch (c) {
+      case 'd':
+      case 'D':
+        if (isdigit(i)) {
+          regexSetAdd(escape, i);
+        }
+        break;
+      case 'w':
+      case 'W':
+        if (isalnum(i) || i == '_') {
+          regexSetAdd(escape, i);
+        }
+        break;
+      case 's':
+      case 'S':
+        if (isspace(i)) {
+          regexSetAdd(escape, i);
+        }
+        break;
+    }
+  }
+
+  if (c == 'D' || c == 'W' || c == 'S') {
+    regexSetInvert(escape);
+  } else if (c == 't') {
+    regexSetAdd(escape, '\t');
+  } else if (!strchr("dws", c)) {
+    regexSetAdd(escape, c);
+  }
+
+  for (int i = 0; i < 32; i++) {
+    set[i] |= escape[i];
+  }
+}
+
+struct regexNode *regexNewNode(struct regexParser *p, int op, struct regexNode *left, struct regexNode *right) {
+  struct regexNode *node = &p->nodes[p->numNodes++];
+
+  memset(node, 0, sizeof(struct regexNode));
+  node->op = op;
+  node->left = left;
+  node->right = right;
+
+  return node;
+}
+
+struct regexNode *regexParseAlt(struct regexParser *p);
+
+struct regexNode *regexParseClass(struct regexParser *p) {
+  struct regexNode *node = regexNewNode(p, RE_CLASS, NULL, NULL);
+  int negate = 0;
+  int first = 1;
+
+  if (*p->s == '^') {
+    negate = 1;
+    p->s++;
+  }
+
+  while (*p->s && (*p->s != ']' || first)) {
+    unsigned char c = *p->s++;
+    first = 0;
+
+    if (c == '\\') {
+      if (*p->s == '\0') {
+        break;
+      }
+
+      regexSetEscape(node->set, (unsigned char) *p->s++);
+    } else if (p->s[0] == '-' && p->s[1] && p->s[1] != ']') {
+      unsigned char last = p->s[1];
+      p->s += 2;
+
+      if (last < c) {
+        p->error = 1;
+      }
+
+      for (int i = c; i <= last; i++) {
+        regexSetAdd(node->set, i);
+      }
+    } else {
+      regexSetAdd(node->set, c);
+    }
+  }
+
+  if (*p->s != ']') {
+    p->error = 1;
+    return node;
+  }
+
+  p->s++;
+
+  if (negate) {
+    regexSetInvert(node->set);
+  }
+
+  return node;
+}
+
+struct regexNode *regexParseAtom(struct regexParser *p) {
+  unsigned char c = *p->s++;
+  struct regexNode *node;
+
+  switch (c) {
+    case '(':
+      node = regexParseAlt(p);
+
+      if (*p->s != ')') {
+        p->error = 1;
+      } else {
+        p->s++;
+      }
+
+      return node;
+    case '[':
+      return regexParseClass(p);
+    case '^':
+      return regexNewNode(p, RE_BOL, NULL, NULL);
+    case '$':
+      return regexNewNode(p, RE_EOL, NULL, NULL);
+    case '*':
+    case '+':
+    case '?':
+      p->error = 1;
+      return regexNewNode(p, RE_EMPTY, NULL, NULL);
+  }
+
+  node = regexNewNode(p, RE_CLASS, NULL, NULL);
+
+  if (c == '.') {
+    memset(node->set, 0xff, sizeof(node->set));
+  } else if (c == '\\') {
+    if (*p->s == '\0') {
+      p->error = 1;
+    } else {
+      regexSetEscape(node->set, (unsigned char) *p->s++);
+    }
+  } else {
+    regexSetAdd(node->set, c);
+  }
+
+  return node;
+}
+
+struct regexNode *regexParseConcat(struct regexParser *p) {
+  struct regexNode *node = NULL;
+
+  while (!p->error && *p->s && *p->s != '|' && *p->s != ')') {
+    struct regexNode *atom = regexParseAtom(p);
+
+    while (*p->s == '*' || *p->s == '+' || *p->s == '?') {
+      int op = *p->s == '*' ? RE_STAR : *p->s == '+' ? RE_PLUS : RE_QUEST;
+      atom = regexNewNode(p, op, atom, NULL);
+      p->s++;
+    }
+
+    node = node ? regexNewNode(p, RE_CAT, node, atom) : atom;
+  }
+
+  return node ? node : regexNewNode(p, RE_EMPTY, NULL, NULL);
+}
+
+struct regexNode *regexParseAlt(struct regexParser *p) {
+  struct regexNode *node = regexParseConcat(p);
+
+  while (!p->error && *p->s == '|') {
+    p->s++;
+    node = regexNewNode(p, RE_ALT, node, regexParseConcat(p));
+  }
+
+  return node;
+}
+
+struct regexInst *regexEmitInst(struct editorRegex *re, int op) {
+  struct regexInst *inst = &re->prog[re->numInsts++];
+
+  memset(inst, 0, sizeof(struct regexInst));
+  inst->op = op;
+  inst->x = re->numInsts;
+
+  return inst;
+}
+
+void regexEmit(struct editorRegex *re, struct regexNode *node) {
+  struct regexInst *inst;
+  int split, jump;
+
+  switch (node->op) {
+    case RE_CLASS:
+      memcpy(regexEmitInst(re, RE_CLASS)->set, node->set, sizeof(node->set));
+      break;
+    case RE_BOL:
+    case RE_EOL:
+      regexEmitInst(re, node->op);
+      break;
+    case RE_CAT:
+      regexEmit(re, node->left);
+      regexEmit(re, node->right);
+      break;
+    case RE_ALT:
+      split = re->numInsts;
+      regexEmitInst(re, RE_SPLIT);
+      regexEmit(re, node->left);
+      jump = re->numInsts;
+      regexEmitInst(re, RE_JMP);
+      re->prog[split].y = re->numInsts;
+      regexEmit(re, node->right);
+      re->prog[jump].x = re->numInsts;
+      break;
+    case RE_STAR:
+      split = re->numInsts;
+      regexEmitInst(re, RE_SPLIT);
+      regexEmit(re, node->left);
+      regexEmitInst(re, RE_JMP)->x = split;
+      re->prog[split].y = re->numInsts;
+      break;
+    case RE_PLUS:
+      split = re->numInsts;
+      regexEmit(re, node->left);
+      inst = regexEmitInst(re, RE_SPLIT);
+      inst->y = inst->x;
+      inst->x = split;
+      break;
+    case RE_QUEST:
+      split = re->numInsts;
+      regexEmitInst(re, RE_SPLIT);
+      regexEmit(re, node->left);
+      re->prog[split].y = re->numInsts;
+      break;
+  }
+}
+
+void regexFirstBytes(struct editorRegex *re, int pc, unsigned char *visited) {
+  while (!visited[pc]) {
+    struct regexInst *inst = &re->prog[pc];
+    visited[pc] = 1;
+
+    switch (inst->op) {
+      case RE_CLASS:
+        for (int i = 0; i < 32; i++) {
+          re->first[i] |= inst->set[i];
+        }
+        return;
+      case RE_EOL:
+      case RE_MATCH:
+        re->skip = 0;
+        return;
+      case RE_SPLIT:
+        regexFirstBytes(re, inst->y, visited);
+        pc = inst->x;
+        break;
+      default:
+        pc = inst->x;
+        break;
+    }
+  }
+}
+
+struct editorRegex *regexCompile(const char *pattern) {
+  struct regexParser p;
+  int length = strlen(pattern);
+
+  p.s = pattern;
+  p.nodes = malloc(sizeof(struct regexNode) * (5 * length + 2));
+  p.numNodes = 0;
+  p.error = 0;
+
+  struct regexNode *root = regexParseAlt(&p);
+
+  if (p.error || *p.s != '\0') {
+    free(p.nodes);
+    return NULL;
+  }
+
+  struct editorRegex *re = malloc(sizeof(struct editorRegex));
+  re->prog = malloc(sizeof(struct regexInst) * (2 * p.numNodes + 1));
+  re->numInsts = 0;
+
+  regexEmit(re, root);
+  regexEmitInst(re, RE_MATCH);
+  free(p.nodes);
+
+  unsigned char *visited = calloc(re->numInsts, 1);
+  memset(re->first, 0, sizeof(re->first));
+  re->skip = 1;
+  regexFirstBytes(re, 0, visited);
+  free(visited);
+
+  re->firstByte = -1;
+
+  for (int i = 0; i < 256; i++) {
+    if (regexSetHas(re->first, i)) {
+      re->firstByte = re->firstByte == -1 ? i : -2;
+    }
+  }
+
+  return re;
+}
+
+void regexFree(struct editorRegex *re) {
+  if (re == NULL) {
+    return;
+  }
+
+  free(re->prog);
+  free(re);
+}
+
+struct regexCache *regexNewCache(struct editorRegex *re) {
+  struct regexCache *cache = malloc(sizeof(struct regexCache));
+
+  cache->states = malloc(sizeof(struct regexDfaState) * WRITEAM_REGEX_STATES);
+  cache->numStates = 0;
+  cache->table = malloc(sizeof(int) * 2 * WRITEAM_REGEX_STATES);
+  memset(cache->table, 0xff, sizeof(int) * 2 * WRITEAM_REGEX_STATES);
+  cache->initial = -1;
+  cache->idle = -1;
+  cache->flushes = 0;
+  cache->set = malloc(sizeof(int) * re->numInsts);
+  cache->numSet = 0;
+  cache->stack = malloc(sizeof(int) * (2 * re->numInsts + 1));
+  cache->mark = calloc(re->numInsts, sizeof(int));
+  cache->markGen = 0;
+  cache->current = malloc(sizeof(struct regexThread) * re->numInsts);
+  cache->next = malloc(sizeof(struct regexThread) * re->numInsts);
+  cache->onList = malloc(sizeof(int) * re->numInsts);
+
+  return cache;
+}
+
+void regexFlushCache(struct regexCache *cache) {
+  for (int i = 0; i < cache->numStates; i++) {
+    free(cache->states[i].pcs);
+  }
+
+  cache->numStates = 0;
+  memset(cache->table, 0xff, sizeof(int) * 2 * WRITEAM_REGEX_STATES);
+  cache->initial = -1;
+  cache->idle = -1;
+  cache->flushes++;
+}
+
+void regexFreeCache(struct regexCache *cache) {
+  if (cache == NULL) {
+    return;
+  }
+
+  regexFlushCache(cache);
+  free(cache->states);
+  free(cache->table);
+  free(cache->set);
+  free(cache->stack);
+  free(cache->mark);
+  free(cache->current);
+  free(cache->next);
+  free(cache->onList);
+  free(cache);
+}
+
+void regexClosure(struct editorRegex *re, struct regexCache *cache, int pc, int bol, int eol) {
+  int depth = 0;
+  cache->stack[depth++] = pc;
+
+  while (depth > 0) {
+    pc = cache->stack[--depth];
+
+    if (cache->mark[pc] == cache->markGen) {
+      continue;
+    }
+
+    cache->mark[pc] = cache->markGen;
+    struct regexInst *inst = &re->prog[pc];
+
+    if (inst->op == RE_SPLIT) {
+      cache->stack[depth++] = inst->y;
+      cache->stack[depth++] = inst->x;
+    } else if (inst->op == RE_JMP || (inst->op == RE_BOL && bol) || (inst->op == RE_EOL && eol)) {
+      cache->stack[depth++] = inst->x;
+    } else if (inst->op != RE_BOL) {
+      cache->set[cache->numSet++] = pc;
+    }
+  }
+}
+
+int regexComparePcs(const void *a, const void *b) {
+  return *(const int *) a - *(const int *) b;
+}
+
+int regexDfaState(struct editorRegex *re, struct regexCache *cache) {
+  unsigned int mask = 2 * WRITEAM_REGEX_STATES - 1;
+  unsigned int hash = 2166136261u;
+
+  qsort(cache->set, cache->numSet, sizeof(int), regexComparePcs);
+
+  for (int i = 0; i < cache->numSet; i++) {
+    hash = (hash ^ cache->set[i]) * 16777619u;
+  }
+
+  unsigned int slot = hash & mask;
+
+  while (cache->table[slot] >= 0) {
+    struct regexDfaState *state = &cache->states[cache->table[slot]];
+
+    if (state->numPcs == cache->numSet && !memcmp(state->pcs, cache->set, sizeof(int) * cache->numSet)) {
+      return cache->table[slot];
+    }
+
+    slot = (slot + 1) & mask;
+  }
+
+  if (cache->numStates == WRITEAM_REGEX_STATES) {
+    regexFlushCache(cache);
+    slot = hash & mask;
+  }
+
+  struct regexDfaState *state = &cache->states[cache->numStates];
+  state->pcs = malloc(sizeof(int) * (cache->numSet ? cache->numSet : 1));
+  memcpy(state->pcs, cache->set, sizeof(int) * cache->numSet);
+  state->numPcs = cache->numSet;
+  state->match = 0;
+  state->matchAtEnd = -1;
+  memset(state->next, 0xff, sizeof(state->next));
+
+  for (int i = 0; i < cache->numSet; i++) {
+    if (re->prog[cache->set[i]].op == RE_MATCH) {
+      state->match = 1;
+    }
+  }
+
+  cache->table[slot] = cache->numStates;
+
+  return cache->numStates++;
+}
+
+int regexDfaStep(struct editorRegex *re, struct regexCache *cache, int from, int c) {
+  struct regexDfaState *state = &cache->states[from];
+
+  cache->markGen++;
+  cache->numSet = 0;
+
+  for (int i = 0; i < state->numPcs; i++) {
+    struct regexInst *inst = &re->prog[state->pcs[i]];
+
+    if (inst->op == RE_CLASS && regexSetHas(inst->set, c)) {
+      regexClosure(re, cache, inst->x, 0, 0);
+    }
+  }
+
+  regexClosure(re, cache, 0, 0, 0);
+
+  int flushes = cache->flushes;
+  int to = regexDfaState(re, cache);
+
+  if (cache->flushes == flushes) {
+    cache->states[from].next[c] = to;
+  }
+
+  return to;
+}
+
+int regexSkip(struct editorRegex *re, const char *s, int len, int at) {
+  if (re->firstByte >= 0) {
+    const char *p = memchr(&s[at], re->firstByte, len - at);
+    return p ? p - s : len;
+  }
+
+  while (at < len && !regexSetHas(re->first, (unsigned char) s[at])) {
+    at++;
+  }
+
+  return at;
+}
+
+int regexRowMatches(struct editorRegex *re, struct regexCache *cache, const char *s, int len) {
+  if (cache->idle < 0) {
+    cache->markGen++;
+    cache->numSet = 0;
+    regexClosure(re, cache, 0, 0, 0);
+    cache->idle = regexDfaState(re, cache);
+  }
+
+  if (cache->initial < 0) {
+    cache->markGen++;
+    cache->numSet = 0;
+    regexClosure(re, cache, 0, 1, 0);
+    cache->initial = regexDfaState(re, cache);
+  }
+
+  int current = cache->initial;
+
+  for (int i = 0; i < len; i++) {
+    if (current == cache->idle && re->skip) {
+      i = regexSkip(re, s, len, i);
+
+      if (i == len) {
+        break;
+      }
+    }
+
+    struct regexDfaState *state = &cache->states[current];
+
+    if (state->match) {
+      return 1;
+    }
+
+    int c = (unsigned char) s[i];
+    current = state->next[c] >= 0 ? state->next[c] : regexDfaStep(re, cache, current, c);
+  }
+
+  struct regexDfaState *state = &cache->states[current];
+
+  if (state->matchAtEnd < 0) {
+    cache->markGen++;
+    cache->numSet = 0;
+
+    for (int i = 0; i < state->numPcs; i++) {
+      if (re->prog[state->pcs[i]].op == RE_EOL) {
+        regexClosure(re, cache, state->pcs[i], 0, 1);
+      }
+    }
+
+    state->matchAtEnd = state->match;
+
+    for (int i = 0; i < cache->numSet; i++) {
+      if (re->prog[cache->set[i]].op == RE_MATCH) {
+        state->matchAtEnd = 1;
+      }
+    }
+  }
+
+  return state->matchAtEnd;
+}
+
+void regexAddThread(struct editorRegex *re, struct regexCache *cache, struct regexThread *list, int *numThreads, int pc, int start, int pos, int len) {
+  if (cache->onList[pc] == pos) {
+    return;
+  }
+
+  cache->onList[pc] = pos;
+  struct regexInst *inst = &re->prog[pc];
+
+  switch (inst->op) {
+    case RE_SPLIT:
+      regexAddThread(re, cache, list, numThreads, inst->x, start, pos, len);
+      regexAddThread(re, cache, list, numThreads, inst->y, start, pos, len);
+      break;
+    case RE_JMP:
+      regexAddThread(re, cache, list, numThreads, inst->x, start, pos, len);
+      break;
+    case RE_BOL:
+      if (pos == 0) {
+        regexAddThread(re, cache, list, numThreads, inst->x, start, pos, len);
+      }
+      break;
+    case RE_EOL:
+      if (pos == len) {
+        regexAddThread(re, cache, list, numThreads, inst->x, start, pos, len);
+      }
+      break;
+    default:
+      list[*numThreads].pc = pc;
+      list[*numThreads].start = start;
+      (*numThreads)++;
+      break;
+  }
+}
+
+int regexSearch(struct editorRegex *re, struct regexCache *cache, const char *s, int len, int from, int *end) {
+  struct regexThread *current = cache->current;
+  struct regexThread *next = cache->next;
+  int numCurrent = 0;
+  int matchStart = -1;
+
+  memset(cache->onList, 0xff, sizeof(int) * re->numInsts);
+
+  for (int i = from; i <= len; i++) {
+    if (matchStart < 0) {
+      if (numCurrent == 0 && re->skip) {
+        i = regexSkip(re, s, len, i);
+
+        if (i == len) {
+          break;
+        }
+      }
+
+      regexAddThread(re, cache, current, &numCurrent, 0, i, i, len);
+    }
+
+    if (numCurrent == 0) {
+      if (matchStart >= 0) {
+        break;
+      }
+
+      continue;
+    }
+
+    int numNext = 0;
+
+    for (int t = 0; t < numCurrent; t++) {
+      struct regexInst *inst = &re->prog[current[t].pc];
+
+      if (inst->op == RE_MATCH) {
+        matchStart = current[t].start;
+        *end = i;
+        break;
+      }
+
+      if (i < len && regexSetHas(inst->set, (unsigned char) s[i])) {
+        regexAddThread(re, cache, next, &numNext, inst->x, current[t].start, i + 1, len);
+      }
+    }
+
+    struct regexThread *swap = current;
+    current = next;
+    next = swap;
+    numCurrent = numNext;
+  }
+
+  return matchStart;
+}
+
+/*** Section 13: Find ***/
+
+char *editorSearchBytes(char *s, int len, const char *query, int queryLength) {
+  if (queryLength == 0) {
+    return s;
+  }
+
+  if (queryLength > len) {
+    return NULL;
+  }
+
+  if (queryLength == 1) {
+    return memchr(s, query[0], len);
+  }
+
+  int i = 0;
+  int last = queryLength - 1;
+
+#if defined(__AVX2__)
+  __m256i wideFirst = _mm256_set1_epi8(query[0]);
+  __m256i wideLast = _mm256_set1_epi8(query[last]);
+
+  for (; i + last + 32 <= len; i += 32) {
+    __m256i blockFirst = _mm256_loadu_si256((const __m256i *) &s[i]);
+    __m256i blockLast = _mm256_loadu_si256((const __m256i *) &s[i + last]);
+    unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(blockFirst, wideFirst), _mm256_cmpeq_epi8(blockLast, wideLast)));
+
+    while (mask) {
+      int at = i + __builtin_ctz(mask);
+
+      if (!memcmp(&s[at + 1], &query[1], queryLength - 2)) {
+        return &s[at];
+      }
+
+      mask &= mask - 1;
+    }
+  }
+#endif
+
+#if defined(__SSE2__)
+  __m128i vecFirst = _mm_set1_epi8(query[0]);
+  __m128i vecLast = _mm_set1_epi8(query[last]);
+
+  for (; i + last + 16 <= len; i += 16) {
+    __m128i blockFirst = _mm_loadu_si128((const __m128i *) &s[i]);
+    __m128i blockLast = _mm_loadu_si128((const __m128i *) &s[i + last]);
+    unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(blockFirst, vecFirst), _mm_cmpeq_epi8(blockLast, vecLast)));
+
+    while (mask) {
+      int at = i + __builtin_ctz(mask);
+
+      if (!memcmp(&s[at + 1], &query[1], queryLength - 2)) {
+        return &s[at];
+      }
+
+      mask &= mask - 1;
+    }
+  }
+#endif
+
+  for (; i + last < len; i++) {
+    if (s[i] == query[0] && s[i + last] == query[last] && !memcmp(&s[i + 1], &query[1], queryLength - 2)) {
+      return &s[i];
+    }
+  }
+
+  return NULL;
+}
+
+void editorSearchRecord(struct editorSearchJob *job, int col) {
+  if (job->numOffsets == job->offsetCap) {
+    job->offsetCap = job->offsetCap ? job->offsetCap * 2 : 256;
+    job->offsets = realloc(job->offsets, sizeof(int) * job->offsetCap);
+  }
+
+  job->offsets[job->numOffsets++] = col;
+}
+
+int editorCountMatches(erow *row, const char *query, int queryLength, struct editorSearchJob *job) {
+  int count = 0;
+  int at = 0;
+  char *match;
+
+  while ((match = editorSearchBytes(&row->chars[at], row->size - at, query, queryLength))) {
+    if (job) {
+      editorSearchRecord(job, match - row->chars);
+    }
+
+    count++;
+    at = (match - row->chars) + queryLength;
+  }
+
+  return count;
+}
+
+int editorCountRegexMatches(erow *row, struct editorRegex *re, struct regexCache *cache, struct editorSearchJob *job) {
+  if (!regexRowMatches(re, cache, row->chars, row->size)) {
+    return 0;
+  }
+
+  int count = 0;
+  int at = 0;
+  int start, end;
+
+  while (at <= row->size && (start = regexSearch(re, cache, row->chars, row->size, at, &end)) >= 0) {
+    if (job) {
+      editorSearchRecord(job, start);
+    }
+
+    count++;
+    at = end > start ? end : end + 1;
+  }
+
+  return count;
+}
+
+unsigned int editorTrigramBucket(unsigned int trigram) {
+  return (trigram * 2654435761u) >> (32 - WRITEAM_INDEX_BITS);
+}
+
+void editorIndexRange(erow *row, int from, int to) {
+  int group = row->id >> WRITEAM_INDEX_GROUP_BITS;
+  unsigned int trigram = 0;
+
+  for (int i = from; i < to; i++) {
+    trigram = ((trigram << 8) | (unsigned char) ROW_CHAR(row, i)) & 0xffffff;
+
+    if (i < from + 2) {
+      continue;
+    }
+
+    struct editorPosting *list = &E.index[editorTrigramBucket(trigram)];
+
+    if (list->len > 0 && list->groups[list->len - 1] == group) {
+      continue;
+    }
+
+    if (list->len == list->cap) {
+      list->cap = list->cap ? list->cap * 2 : 4;
+      list->groups = realloc(list->groups, sizeof(int) * list->cap);
+    }
+
+    list->groups[list->len++] = group;
+  }
+}
+
+void editorIndexRow(erow *row) {
+  editorIndexRange(row, 0, row->size);
+}
+
+void editorIndexTouch(erow *row) {
+  if (E.index == NULL || row->indexDirty) {
+    return;
+  }
+
+  if (E.numIndexDirty == E.indexDirtyCap) {
+    E.indexDirtyCap = E.indexDirtyCap ? E.indexDirtyCap * 2 : 64;
+    E.indexDirty = realloc(E.indexDirty, sizeof(erow *) * E.indexDirtyCap);
+  }
+
+  E.indexDirty[E.numIndexDirty++] = row;
+  row->indexDirty = 1;
+}
+
+void editorIndexEdit(erow *row, int at, int delta) {
+  if (E.index == NULL || row->indexDirty) {
+    return;
+  }
+
+  if (row->size < WRITEAM_LONG_LINE || (E.indexFrontier && docRowIndex(E.indexFrontier) <= docRowIndex(row))) {
+    editorIndexTouch(row);
+    return;
+  }
+
+  int from = at > 2 ? at - 2 : 0;
+  int to = at + (delta > 0 ? delta : 0) + 2;
+
+  if (to > row->size) {
+    to = row->size;
+  }
+
+  editorIndexRange(row, from, to);
+}
+
+int editorIndexPending() {
+  return E.indexFrontier != NULL || E.numIndexDirty > 0;
+}
+
+int editorIndexBatch() {
+  int budget = WRITEAM_HL_BATCH;
+
+  while (E.numIndexDirty > 0 && budget > 0) {
+    erow *row = E.indexDirty[--E.numIndexDirty];
+
+    if (!row->indexDirty || E.rowById[row->id] != row) {
+      continue;
+    }
+
+    budget -= row->size + 1;
+    editorIndexRow(row);
+    row->indexDirty = 0;
+  }
+
+  while (E.indexFrontier && budget > 0) {
+    erow *row = E.indexFrontier;
+    E.indexFrontier = docNextRow(row);
+    budget -= row->size + 1;
+
+    if (!row->indexDirty) {
+      editorIndexRow(row);
+    }
+  }
+
+  return editorIndexPending();
+}
+
+int editorCompareMatchRows(const void *a, const void *b) {
+  const struct editorMatchRow *x = a;
+  const struct editorMatchRow *y = b;
+
+  return (x->at > y->at) - (x->at < y->at);
+}
+
+void editorAddCandidate(struct editorMatchRow **candidates, int *numCandidates, int *cap, erow *row) {
+  if (*numCandidates == *cap) {
+    *cap = *cap ? *cap * 2 : 64;
+    *candidates = realloc(*candidates, sizeof(struct editorMatchRow) * *cap);
+  }
+
+  (*candidates)[*numCandidates].at = docRowIndex(row);
+  (*candidates)[*numCandidates].row = row;
+  (*candidates)[*numCandidates].count = 0;
+  (*candidates)[*numCandidates].first = 0;
+  (*numCandidates)++;
+}
+
+int editorIndexCandidates(const char *query, struct editorMatchRow **matches, int *numMatches) {
+  int queryLength = strlen(query);
+
+  if (E.index == NULL || E.indexFrontier || queryLength < 3) {
+    return 0;
+  }
+
+  struct editorPosting *lists[WRITEAM_INDEX_LISTS];
+  int numLists = 0;
+  unsigned int trigram = 0;
+
+  for (int i = 0; i < queryLength; i++) {
+    trigram = ((trigram << 8) | (unsigned char) query[i]) & 0xffffff;
+
+    if (i < 2) {
+      continue;
+    }
+
+    struct editorPosting *list = &E.index[editorTrigramBucket(trigram)];
+    int j = 0;
+
+    while (j < numLists && lists[j] != list) {
+      j++;
+    }
+
+    if (j < numLists) {
+      continue;
+    }
+
+    if (numLists < WRITEAM_INDEX_LISTS) {
+      lists[numLists++] = list;
+      j = numLists - 1;
+    } else if (list->len < lists[numLists - 1]->len) {
+      lists[numLists - 1] = list;
+      j = numLists - 1;
+    } else {
+      continue;
+    }
+
+    while (j > 0 && lists[j]->len < lists[j - 1]->len) {
+      struct editorPosting *swap = lists[j];
+      lists[j] = lists[j - 1];
+      lists[j - 1] = swap;
+      j--;
+    }
+  }
+
+  int numGroups = (E.numRowIds >> WRITEAM_INDEX_GROUP_BITS) + 1;
+
+  if (lists[0]->len > numGroups / 4) {
+    return 0;
+  }
+
+  unsigned char *hits = calloc(numGroups, 1);
+
+  for (int k = 0; k < numLists; k++) {
+    for (int i = 0; i < lists[k]->len; i++) {
+      int group = lists[k]->groups[i];
+
+      if (hits[group] == k) {
+        hits[group] = k + 1;
+      }
+    }
+  }
+
+  struct editorMatchRow *candidates = NULL;
+  int numCandidates = 0;
+  int cap = 0;
+
+  for (int group = 0; group < numGroups; group++) {
+    if (hits[group] != numLists) {
+      continue;
+    }
+
+    for (int id = group << WRITEAM_INDEX_GROUP_BITS; id < E.numRowIds && id < (group + 1) << WRITEAM_INDEX_GROUP_BITS; id++) {
+      if (E.rowById[id] && !E.rowById[id]->indexDirty) {
+        editorAddCandidate(&candidates, &numCandidates, &cap, E.rowById[id]);
+      }
+    }
+  }
+
+  for (int i = 0; i < E.numIndexDirty; i++) {
+    erow *row = E.indexDirty[i];
+
+    if (row->indexDirty && E.rowById[row->id] == row) {
+      editorAddCandidate(&candidates, &numCandidates, &cap, row);
+    }
+  }
+
+  free(hits);
+
+  if (numCandidates > 1) {
+    qsort(candidates, numCandidates, sizeof(struct editorMatchRow), editorCompareMatchRows);
+  }
+
+  int unique = 0;
+
+  for (int i = 0; i < numCandidates; i++) {
+    if (unique == 0 || candidates[unique - 1].row != candidates[i].row) {
+      candidates[unique++] = candidates[i];
+    }
+  }
+
+  *matches = candidates;
+  *numMatches = unique;
+
+  return 1;
+}
+
+void *editorSearchWorker(void *arg) {
+  struct editorSearchJob *job = arg;
+  struct regexCache *cache = job->regex ? regexNewCache(job->regex) : NULL;
+  int cap = 0;
+  erow *row = job->candidates ? NULL : docRowAt(job->start);
+
+  struct editorSearchJob *record = job->record ? job : NULL;
+
+  job->found = NULL;
+  job->numFound = 0;
+  job->total = 0;
+  job->offsets = NULL;
+  job->numOffsets = 0;
+  job->offsetCap = 0;
+
+  for (int i = job->start; i < job->end; i++) {
+    int at = i;
+
+    if (job->candidates) {
+      row = job->candidates[i].row;
+      at = job->candidates[i].at;
+    }
+
+    int count;
+    int first = job->numOffsets;
+
+    if (job->regex) {
+      count = editorCountRegexMatches(row, job->regex, cache, record);
+    } else {
+      count = editorCountMatches(row, job->query, job->queryLength, record);
+    }
+
+    if (count > 0) {
+      if (job->numFound == cap) {
+        cap = cap ? cap * 2 : 64;
+        job->found = realloc(job->found, sizeof(struct editorMatchRow) * cap);
+      }
+
+      job->found[job->numFound].at = at;
+      job->found[job->numFound].row = row;
+      job->found[job->numFound].count = count;
+      job->found[job->numFound].first = first;
+      job->numFound++;
+      job->total += count;
+    }
+
+    if (!job->candidates) {
+      row = docNextRow(row);
+    }
+  }
+
+  regexFreeCache(cache);
+
+  return NULL;
+}
+
+int editorSearchRows(const char *query, struct editorRegex *regex, struct editorMatchRow **matches, int *numMatches, int **offsets) {
+  struct editorSearchJob jobs[WRITEAM_SEARCH_THREADS];
+  pthread_t threads[WRITEAM_SEARCH_THREADS];
+  struct editorMatchRow *candidates = *matches;
+  int numRows = candidates ? *numMatches : E.numRows;
+  int numJobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (numJobs > WRITEAM_SEARCH_THREADS) {
+    numJobs = WRITEAM_SEARCH_THREADS;
+  }
+
+  if (numJobs < 1 || numRows < WRITEAM_SEARCH_SPLIT * numJobs) {
+    numJobs = 1;
+  }
+
+  for (int t = 0; t < numJobs; t++) {
+    jobs[t].query = query;
+    jobs[t].queryLength = strlen(query);
+    jobs[t].regex = regex;
+    jobs[t].candidates = candidates;
+    jobs[t].start = (long long) numRows * t / numJobs;
+    jobs[t].end = (long long) numRows * (t + 1) / numJobs;
+    jobs[t].record = (offsets != NULL);
+
+    if (t > 0 && pthread_create(&threads[t], NULL, editorSearchWorker, &jobs[t]) != 0) {
+      die("pthread_create");
+    }
+  }
+
+  editorSearchWorker(&jobs[0]);
+
+  int numFound = 0;
+  int total = 0;
+
+  for (int t = 0; t < numJobs; t++) {
+    if (t > 0) {
+      pthread_join(threads[t], NULL);
+    }
+
+    numFound += jobs[t].numFound;
+    total += jobs[t].total;
+  }
+
+  struct editorMatchRow *found = malloc(sizeof(struct editorMatchRow) * (numFound ? numFound : 1));
+  int *all = offsets ? malloc(sizeof(int) * (total ? total : 1)) : NULL;
+  int numOffsets = 0;
+  numFound = 0;
+
+  for (int t = 0; t < numJobs; t++) {
+    if (jobs[t].numFound > 0) {
+      memcpy(&found[numFound], jobs[t].found, sizeof(struct editorMatchRow) * jobs[t].numFound);
+    }
+
+    for (int i = 0; offsets && i < jobs[t].numFound; i++) {
+      found[numFound + i].first += numOffsets;
+    }
+
+    if (jobs[t].numOffsets > 0) {
+      memcpy(&all[numOffsets], jobs[t].offsets, sizeof(int) * jobs[t].numOffsets);
+    }
+
+    numFound += jobs[t].numFound;
+    numOffsets += jobs[t].numOffsets;
+    free(jobs[t].found);
+    free(jobs[t].offsets);
+  }
+
+  if (offsets) {
+    free(*offsets);
+    *offsets = all;
+  }
+
+  free(candidates);
+  *matches = found;
+  *numMatches = numFound;
+
+  return total;
+}
+
+void editorFindCallback(char *query, int key) {
+  static struct editorMatchRow *matches = NULL;
+  static int *offsets = NULL;
+  static int numMatches = 0;
+  static int entry = 0;
+  static int occurrence = 0;
+  static char *last_query = NULL;
+  static int deferred = 0;
+  static struct editorRegex *regex = NULL;
+  static struct regexCache *cache = NULL;
+
+  E.matchRow = NULL;
+
+  int queryLength = strlen(query);
+  int step = key == ARROW_RIGHT || key == ARROW_DOWN || key == ARROW_LEFT || key == ARROW_UP;
+
+  if (key == '\x1b' || (key == '\r' && !deferred)) {
+    free(matches);
+    matches = NULL;
+    free(offsets);
+    offsets = NULL;
+    numMatches = 0;
+    free(last_query);
+    last_query = NULL;
+    regexFreeCache(cache);
+    cache = NULL;
+    regexFree(regex);
+    regex = NULL;
+    deferred = 0;
+    E.matchCount = -1;
+    return;
+  }
+
+  if (key == '\t') {
+    E.findRegex = !E.findRegex;
+    free(last_query);
+    last_query = NULL;
+  }
+
+  if (!step && editorKeysPending()) {
+    deferred = 1;
+    return;
+  }
+
+  if (deferred) {
+    step = 0;
+    deferred = 0;
+  }
+
+  if (step && (key == ARROW_RIGHT || key == ARROW_DOWN)) {
+    if (numMatches == 0) {
+      return;
+    }
+
+    if (++occurrence == matches[entry].count) {
+      entry = (entry + 1) % numMatches;
+      occurrence = 0;
+    }
+
+    E.matchNumber = E.matchNumber % E.matchCount + 1;
+  } else if (step) {
+    if (numMatches == 0) {
+      return;
+    }
+
+    if (occurrence-- == 0) {
+      entry = (entry + numMatches - 1) % numMatches;
+      occurrence = matches[entry].count - 1;
+    }
+
+    E.matchNumber = (E.matchNumber + E.matchCount - 2) % E.matchCount + 1;
+  } else {
+    int lastLength = last_query ? (int) strlen(last_query) : 0;
+    int refine = !E.findRegex && lastLength > 0 && queryLength > lastLength && !strncmp(query, last_query, lastLength);
+    int narrowed = refine;
+
+    if (!refine) {
+      free(matches);
+      matches = NULL;
+      numMatches = 0;
+      narrowed = !E.findRegex && editorIndexCandidates(query, &matches, &numMatches);
+    }
+
+    free(last_query);
+    last_query = strdup(query);
+
+    regexFreeCache(cache);
+    cache = NULL;
+    regexFree(regex);
+    regex = NULL;
+
+    if (E.findRegex && queryLength > 0) {
+      regex = regexCompile(query);
+      cache = regex ? regexNewCache(regex) : NULL;
+    }
+
+    if (queryLength == 0 || (narrowed && numMatches == 0) || (E.findRegex && regex == NULL)) {
+      free(matches);
+      matches = NULL;
+      numMatches = 0;
+      E.matchCount = 0;
+    } else {
+      E.matchCount = editorSearchRows(query, regex, &matches, &numMatches, &offsets);
+    }
+
+    E.matchNumber = E.matchCount ? 1 : 0;
+    entry = 0;
+    occurrence = 0;
+  }
+
+  if (numMatches != 0) {
+    erow *row = matches[entry].row;
+    int end;
+
+    E.cursorY = matches[entry].at;
+    E.cursorX = offsets[matches[entry].first + occurrence];
+    E.rowoff = E.numRows;
+
+    if (regex) {
+      E.matchLen = regexSearch(regex, cache, row->chars, row->size, E.cursorX, &end) == E.cursorX ? end - E.cursorX : 0;
+    } else {
+      E.matchLen = queryLength;
+    }
+
+    E.matchRow = row;
+    E.matchAt = E.cursorX;
+  }
+
+  if (key == '\r') {
+    editorFindCallback(query, key);
   }
+}
+
+void editorFind() {
+  int saved_cx = E.cursorX;
+  int saved_cy = E.cursorY;
+  int saved_coloff = E.coloff;
+  int saved_rowoff = E.rowoff;
 
-  erow *row = &E.row[E.cursorY];
+  editorRowCloseGap(E.gapRow);
+  E.matchCount = 0;
+  E.matchNumber = 0;
 
-  if (E.cursorX
- > 0) {
-    editorRowDelChar(row, E.cursorX
-   - 1);
-    E.cursorX
---;
+  char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter, Tab = Regex)", editorFindCallback, 0);
+
+  if (query) {
+    free(query);;
   } else {
     E.cursorX
- = E.row[E.cursorY - 1].size;
-    editorRowAppendString(&E.row[E.cursorY - 1], row->chars, row->size);
-    editorDelRow(E.cursorY);
-    E.cursorY--;
+ = saved_cx;
+    E.cursorY = saved_cy;
+    E.coloff = saved_coloff;
+    E.rowoff = saved_rowoff;
   }
 }
 
-/*** Section 10: File I/O ***/
+int editorReplaceRow(erow *row, int count, const char *query, struct editorRegex *regex, struct regexCache *cache, const char *replacement) {
+  int queryLength = strlen(query);
+  int replacementLength = strlen(replacement);
+  char *chars = malloc(row->size + count * replacementLength + 1);
+  int size = 0;
+  int at = 0;
+  int replaced = 0;
 
-char *editorRowsToString(int *buflen) {
-  int totalLength = 0;
-
-  for (int i = 0; i < E.numRows; i++) {
-    totalLength += E.row[i].size + 1;
-  }
+  while (replaced < count && at <= row->size) {
+    int start, end;
 
-  *buflen = totalLength;
+    if (regex) {
+      start = regexSearch(regex, cache, row->chars, row->size, at, &end);
+    } else {
+      char *match = editorSearchBytes(&row->chars[at], row->size - at, query, queryLength);
+      start = match ? match - row->chars : -1;
+      end = start + queryLength;
+    }
 
-  char *buf = malloc(totalLength);
-  char *p = buf;
+    if (start < 0) {
+      break;
+    }
 
-  for (int i = 0; i < E.numRows; i++) {
-    memcpy(p, E.row[i].chars, E.row[i].size);
-    p += E.row[i].size;
-    *p = '\n';
-    p++;
-  }
-  return buf;
-}
+    memcpy(&chars[size], &row->chars[at], start - at);
+    size += start - at;
 
-void editorOpen(char *fileName) {
-  free(E.fileName);
-  E.fileName = strdup(fileName);
+    if (end > start) {
+      editorUndoRecord(UNDO_DELETE, row, size, &row->chars[start], end - start, 0);
+    }
 
-  editorSelectSyntaxHighlight();
+    if (replacementLength > 0) {
+      editorUndoRecord(UNDO_INSERT, row, size, replacement, replacementLength, 0);
+    }
 
-  FILE *fp = fopen(fileName, "r");
-  if (!fp) {
-    die("fopen");
-  }
+    memcpy(&chars[size], replacement, replacementLength);
+    size += replacementLength;
+    replaced++;
 
-  char *line = NULL;
-  size_t lineCap = 0;
-  ssize_t lineLength;
+    if (end > start) {
+      at = end;
+    } else {
+      if (start < row->size) {
+        chars[size++] = row->chars[start];
+      }
 
-  while ((lineLength = getline(&line, &lineCap, fp)) != -1) {
-    while (lineLength > 0 && (line[lineLength - 1] == '\n' || line[lineLength - 1] == '\r')) {
-      lineLength--;
+      at = start + 1;
     }
-    editorInsertRow(E.numRows, line, lineLength);
   }
-  
-  free(line);
-  fclose(fp);
-  E.dirty = 0;
-}
-
-void editorSave() {
-  if (E.fileName == NULL) {
-    E.fileName = editorPrompt("Save As: %s (ESC to cancel)", NULL);
-    if (E.fileName == NULL) {
-      editorSetStatusMessage("Save Aborted");
-      return;
-    }
 
-    editorSelectSyntaxHighlight();
+  if (at < row->size) {
+    memcpy(&chars[size], &row->chars[at], row->size - at);
+    size += row->size - at;
   }
 
-  int len;
-  char *buf = editorRowsToString(&len);
+  chars[size] = '\0';
 
-  int fd = open(E.fileName, O_RDWR | O_CREAT, 0644);
+  editorRowReleaseChars(row);
+  row->chars = chars;
+  row->mapped = 0;
+  row->size = size;
 
-  if (fd != -1) {
-    if (ftruncate(fd, len) != -1) {
-      if (write(fd, buf, len) == len) {
-        close(fd);
-        free(buf);
-        E.dirty = 0;
-        editorSetStatusMessage("%d bytes written to disk", len);
-        return;
-      }
-    }
-    close(fd);
-  }
-  free(buf);
-  editorSetStatusMessage("Save Failed! I/O Error: %s", strerror(errno));
-}
+  editorUnmarkStale(row);
+  free(row->hl);
+  row->hl = NULL;
+  free(row->hlCheckpoints);
+  row->hlCheckpoints = NULL;
+  row->hlNumCheckpoints = 0;
+  row->longLine = 0;
+  row->rxNumCheckpoints = 0;
 
-/*** Section 11: Find ***/
+  editorIndexTouch(row);
 
-void editorFindCallback(char *query, int key) {
-  static int last_match = -1;
-  static int direction = 1;
+  return replaced;
+}
 
-  static int saved_hl_line;
-  static char *saved_hl = NULL;
+void editorReplace() {
+  editorRowCloseGap(E.gapRow);
 
-  if (saved_hl) {
-    memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-    free(saved_hl);
-    saved_hl = NULL;
+  char *query = editorPrompt(E.findRegex ? "Replace regex: %s (ESC to cancel)" : "Replace: %s (ESC to cancel)", NULL, 0);
+
+  if (query == NULL) {
+    return;
   }
 
-  if (key == '\r' || key == '\x1b') {
-    last_match = -1;
-    direction = 1;
+  char *replacement = editorPrompt("Replace with: %s (ESC to cancel)", NULL, 1);
+
+  if (replacement == NULL) {
+    free(query);
     return;
-  } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-    direction = 1;
-  } else if (key == ARROW_LEFT || key == ARROW_UP) {
-    direction = -1;
-  } else {
-    last_match = -1;
-    direction = 1;
   }
 
-  if (last_match == -1) {
-    direction = 1;
+  struct editorRegex *regex = NULL;
+
+  if (E.findRegex && (regex = regexCompile(query)) == NULL) {
+    editorSetStatusMessage("Invalid regex: %s", query);
+    free(query);
+    free(replacement);
+    return;
   }
 
-  int current = last_match;
+  struct editorMatchRow *matches = NULL;
+  int numMatches = 0;
 
-  for (int i = 0; i < E.numRows; i++) {
-    current += direction;
+  int narrowed = !regex && editorIndexCandidates(query, &matches, &numMatches);
 
-    if (current == -1) {
-      current = E.numRows - 1;
-    } else if (current == E.numRows) {
-      current = 0;
-    }
+  if (!narrowed || numMatches > 0) {
+    editorSearchRows(query, regex, &matches, &numMatches, NULL);
+  }
 
-    erow *row = &E.row[current];
-    char *match = strstr(row->render, query);
+  struct regexCache *cache = regex ? regexNewCache(regex) : NULL;
+  int replaced = 0;
 
-    if (match) {
-      last_match = current;
-      E.cursorY = current;
-      E.cursorX
-   = editorRowRxToCx(row, match - row->render);
-      E.rowoff = E.numRows;
+  for (int i = 0; i < numMatches; i++) {
+    replaced += editorReplaceRow(matches[i].row, matches[i].count, query, regex, cache, replacement);
+  }
 
-      saved_hl_line = current;
-      saved_hl = malloc(row->rsize);
-      memcpy(saved_hl, row->hl, row->rsize);
-      memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-      break;
+  if (numMatches > 0) {
+    if (E.hlFrontier == NULL || docRowIndex(E.hlFrontier) > matches[0].at) {
+      E.hlFrontier = matches[0].row;
     }
-  }
-}
 
-void editorFind() {
-  int saved_cx = E.cursorX;
-  int saved_cy = E.cursorY;
-  int saved_coloff = E.coloff;
-  int saved_rowoff = E.rowoff;
+    erow *row = docRowAt(E.cursorY);
 
-  char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
+    if (row && E.cursorX > row->size) {
+      E.cursorX = row->size;
+    }
 
-  if (query) {
-    free(query);;
-  } else {
-    E.cursorX
- = saved_cx;
-    E.cursorY = saved_cy;
-    E.coloff = saved_coloff;
-    E.rowoff = saved_rowoff;
+    E.dirty++;
   }
+
+  editorSetStatusMessage("Replaced %d occurrence%s", replaced, replaced == 1 ? "" : "s");
+
+  regexFreeCache(cache);
+  regexFree(regex);
+  free(matches);
+  free(query);
+  free(replacement);
 }
 
-/*** Section 12: Append Buffer ***/
+/*** Section 14: Append Buffer ***/
 
 struct abuf {
   char *b;
   int len;
+  int cap;
 };
 
-#define ABUF_INIT {NULL, 0}
+#define ABUF_INIT {NULL, 0, 0}
 
-void abAppend(struct abuf *ab, const char *s, int len) {
-  char *new = realloc(ab->b, ab->len + len);
+int abReserve(struct abuf *ab, int len) {
+  if (ab->len + len <= ab->cap) {
+    return 1;
+  }
+
+  int cap = ab->cap ? ab->cap : 4096;
+
+  while (cap < ab->len + len) {
+    cap *= 2;
+  }
+
+  char *new = realloc(ab->b, cap);
 
   if (new == NULL) {
-    return;
+    return 0;
   }
 
-  memcpy(&new[ab->len], s, len);
   ab->b = new;
+  ab->cap = cap;
+
+  return 1;
+}
+
+void abAppend(struct abuf *ab, const char *s, int len) {
+  if (!abReserve(ab, len)) {
+    return;
+  }
+
+  memcpy(&ab->b[ab->len], s, len);
   ab->len += len;
 }
 
-void abFree(struct abuf *ab) {
-  free(ab->b);
+void abAppendNumber(struct abuf *ab, int n) {
+  char digits[12];
+  int i = sizeof(digits);
+
+  do {
+    digits[--i] = '0' + n % 10;
+    n /= 10;
+  } while (n > 0);
+
+  abAppend(ab, &digits[i], sizeof(digits) - i);
+}
+
+void abAppendCursor(struct abuf *ab, int y, int x) {
+  abAppend(ab, "\x1b[", 2);
+  abAppendNumber(ab, y);
+  abAppend(ab, ";", 1);
+  abAppendNumber(ab, x);
+  abAppend(ab, "H", 1);
 }
 
-/*** Section 13: Output ***/
+/*** Section 15: Output ***/
 
 void editorScroll() {
   E.rx = 0;
 
   if (E.cursorY < E.numRows) {
-    E.rx = editorRowCxToRx(&E.row[E.cursorY], E.cursorX
+    E.rx = editorRowCxToRx(docRowAt(E.cursorY), E.cursorX
 );
   }
 
@@ -886,12 +5060,48 @@ void editorScroll() {
   }
 }
 
-void editorDrawRows(struct abuf *ab) {
-  for (int i = 0; i < E.screenRows; i++) {
-    int fileRow = i + E.rowoff;
+void editorPutCell(int y, int x, unsigned int ch, unsigned char style) {
+  if (y < 0 || y >= E.screenRows + 2 || x < 0 || x >= E.screenCols) {
+    return;
+  }
+
+  struct editorCell *cell = &E.frame[y * E.screenCols + x];
+  cell->ch = ch;
+  cell->style = style;
+}
+
+int editorPutString(int y, int x, const char *s, int len, unsigned char style) {
+  for (int i = 0; i < len;) {
+    unsigned int cp;
+    i += editorDecodeUtf8((const unsigned char *) &s[i], len - i, &cp);
+
+    if (editorCharWidth(cp) == 2) {
+      editorPutCell(y, x++, cp, style);
+      editorPutCell(y, x++, CELL_WIDE_TAIL, style);
+    } else if (editorCharWidth(cp) == 1) {
+      editorPutCell(y, x++, cp, style);
+    }
+  }
+
+  return x;
+}
+
+void editorClearLine(int y, unsigned char style) {
+  for (int x = 0; x < E.screenCols; x++) {
+    editorPutCell(y, x, ' ', style);
+  }
+}
+
+void editorDrawRows() {
+  editorResolveStaleRows();
 
-    if (fileRow >= E.numRows) {
-      if (E.numRows == 0 && i == E.screenRows / 3) {
+  erow *row = docRowAt(E.rowoff);
+
+  for (int y = 0; y < E.screenRows; y++) {
+    editorClearLine(y, HL_NORMAL);
+
+    if (row == NULL) {
+      if (E.numRows == 0 && y == E.screenRows / 3) {
         char welcome[80];
         int welcomeLength = snprintf(welcome, sizeof(welcome), "writeAM Editor -- Version %s", WRITEAM_VERSION);
 
@@ -901,132 +5111,203 @@ void editorDrawRows(struct abuf *ab) {
 
         int padding = (E.screenCols - welcomeLength) / 2;
 
-        if (padding) {
-          abAppend(ab, "~", 1);
-          padding--;
-        }
-
-        while (padding--) {
-          abAppend(ab, " ", 1);
-        }
-
-        abAppend(ab, welcome, welcomeLength);
+        editorPutCell(y, 0, '~', HL_NORMAL);
+        editorPutString(y, padding, welcome, welcomeLength, HL_NORMAL);
       } else {
-        abAppend(ab, "~", 1);
+        editorPutCell(y, 0, '~', HL_NORMAL);
       }
-    } else {
-      int len = E.row[fileRow].rsize - E.coloff;
 
-      if (len < 0) {
-        len = 0;
+      continue;
+    }
+
+    int cx = editorRowRxToCx(row, E.coloff);
+    int rx = editorRowCxToRx(row, cx);
+    int windowAt = cx;
+    unsigned char *window = NULL;
+
+    if (row->longLine) {
+      int windowEnd = editorRowRxToCx(row, E.coloff + E.screenCols) + 4;
+
+      if (windowEnd > row->size) {
+        windowEnd = row->size;
       }
 
-      if (len > E.screenCols) {
-        len = E.screenCols;
+      if (windowEnd - windowAt > E.hlWindowCap) {
+        E.hlWindowCap = windowEnd - windowAt;
+        E.hlWindow = realloc(E.hlWindow, E.hlWindowCap);
       }
 
-      char *c = &E.row[fileRow].render[E.coloff];
-      unsigned char *hl = &E.row[fileRow].hl[E.coloff];
-      int currentColor = -1;
-      for (int i = 0; i < len; i++) {
-        if (iscntrl(c[i])) {
-          char sym = (c[i] <= 26) ? '@' + c[i] : '?';
-          abAppend(ab, "\x1b[7m", 4);
-          abAppend(ab, &sym, 1);
-          abAppend(ab, "\x1b[m", 3);
-
-          if (currentColor != -1) {
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", currentColor);
-            abAppend(ab, buf, clen);
-          }
-        } else if (hl[i] == HL_NORMAL) {
-          if (currentColor != -1) {
-            abAppend(ab, "\x1b[39m", 5);
-            currentColor = -1;
-          }
+      window = E.hlWindow;
+      editorHighlightWindow(row, windowAt, windowEnd, window);
+    }
 
-          abAppend(ab, &c[i], 1);
-        } else {
-          int color = editorSyntaxToColor(hl[i]);
+    while (cx < row->size && rx < E.coloff + E.screenCols) {
+      unsigned int c = (unsigned char) ROW_CHAR(row, cx);
+      unsigned char hl = row->hl ? ROW_HL(row, cx) : window ? window[cx - windowAt] : HL_NORMAL;
 
-          if (color != currentColor) {
-            currentColor = color;
-            char buf[16];
-            int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-            abAppend(ab, buf, clen);
-          }
+      if (row == E.matchRow && cx >= E.matchAt && cx < E.matchAt + E.matchLen) {
+        hl = HL_MATCH;
+      }
+
+      int length = 1;
+      int width = 1;
+
+      if (c == '\t') {
+        c = ' ';
+        width = WRITEAM_TAB_STOP - (rx % WRITEAM_TAB_STOP);
+      } else if (c >= 0x80) {
+        length = editorRowDecode(row, cx, &c);
+        width = editorCharWidth(c);
+      }
 
-          abAppend(ab, &c[i], 1);
+      if (c < 0x20 || c == 0x7f || (c >= 0x80 && c < 0xa0)) {
+        editorPutCell(y, rx - E.coloff, (c <= 26) ? '@' + c : '?', hl | CELL_INVERSE);
+      } else if (width == 2 && rx >= E.coloff && rx + 1 < E.coloff + E.screenCols) {
+        editorPutCell(y, rx - E.coloff, c, hl);
+        editorPutCell(y, rx + 1 - E.coloff, CELL_WIDE_TAIL, hl);
+      } else {
+        for (int i = 0; i < width; i++) {
+          editorPutCell(y, rx + i - E.coloff, width == 1 ? c : ' ', hl);
         }
       }
-      abAppend(ab, "\x1b[39m", 5);
+
+      cx += length;
+      rx += width;
     }
-  
 
-    abAppend(ab, "\x1b[K", 3);
-    abAppend(ab, "\r\n", 2);
+    row = docNextRow(row);
   }
 }
 
-void editorDrawStatusBar(struct abuf *ab) {
-  abAppend(ab, "\x1b[7m", 4);
+void editorDrawStatusBar() {
+  int y = E.screenRows;
   char status[80], rstatus[80];
-  int len = snprintf(status, sizeof(status), "%.20s - %d lines %s", E.fileName ? E.fileName : "[No Name]", E.numRows, E.dirty ? "(modified)" : "");
-  int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d", E.syntax ? E.syntax->fileType : "No Filetype", E.cursorY + 1, E.numRows);
+  int len = snprintf(status, sizeof(status), "%.20s - %d lines %s%s", E.fileName ? E.fileName : "[No Name]", E.numRows, E.stream ? "(loading) " : "", E.dirty ? "(modified)" : "");
+  int rlen;
+
+  if (E.matchCount >= 0) {
+    rlen = snprintf(rstatus, sizeof(rstatus), "%s %d of %d | %s | %d/%d", E.findRegex ? "regex" : "match", E.matchNumber, E.matchCount, E.syntax ? E.syntax->fileType : "No Filetype", E.cursorY + 1, E.numRows);
+  } else {
+    rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d", E.syntax ? E.syntax->fileType : "No Filetype", E.cursorY + 1, E.numRows);
+  }
 
   if (len > E.screenCols) {
     len = E.screenCols;
   }
-  
-  abAppend(ab, status, len);
 
-  while (len < E.screenCols) {
-    if (E.screenCols - len == rlen) {
-      abAppend(ab, rstatus, rlen);
-      break;
-    } else {
-      abAppend(ab, " ", 1);
-      len++;
-    }
+  editorClearLine(y, HL_NORMAL | CELL_INVERSE);
+  editorPutString(y, 0, status, len, HL_NORMAL | CELL_INVERSE);
+
+  if (E.screenCols - len >= rlen) {
+    editorPutString(y, E.screenCols - rlen, rstatus, rlen, HL_NORMAL | CELL_INVERSE);
   }
-  abAppend(ab, "\x1b[m", 3);
-  abAppend(ab, "\r\n", 2);
 }
 
-void editorDrawMessageBar(struct abuf *ab) {
-  abAppend(ab, "\x1b[K", 3);
+void editorDrawMessageBar() {
+  int y = E.screenRows + 1;
   int msglen = strlen(E.statusmsg);
 
   if (msglen > E.screenCols) {
     msglen = E.screenCols;
   }
 
+  editorClearLine(y, HL_NORMAL);
+
   if (msglen && time(NULL) - E.statusmsg_time < 5) {
-    abAppend(ab, E.statusmsg, msglen);
+    editorPutString(y, 0, E.statusmsg, msglen, HL_NORMAL);
+  }
+}
+
+void editorInitStyles() {
+  for (int i = 0; i < CELL_STYLES; i++) {
+    int hl = i % (HL_MATCH + 1);
+    int color = editorSyntaxToColor(hl);
+
+    if (hl == HL_NORMAL) {
+      color = 39;
+    }
+
+    E.styleLength[i] = snprintf(E.styleEscape[i], sizeof(E.styleEscape[i]), "\x1b[0;%s%dm", i > HL_MATCH ? "7;" : "", color);
+  }
+}
+
+void editorFlushFrame(struct abuf *ab) {
+  int numCells = (E.screenRows + 2) * E.screenCols;
+  int pen = -1;
+  int i = 0;
+
+  while (i < numCells) {
+    if (E.frame[i].ch == E.shadow[i].ch && E.frame[i].style == E.shadow[i].style) {
+      i++;
+      continue;
+    }
+
+    int lineEnd = (i / E.screenCols + 1) * E.screenCols;
+    abAppendCursor(ab, i / E.screenCols + 1, i % E.screenCols + 1);
+
+    while (i < lineEnd && (E.frame[i].ch != E.shadow[i].ch || E.frame[i].style != E.shadow[i].style)) {
+      unsigned char style = E.frame[i].style;
+
+      if (style != pen) {
+        int index = (style & CELL_INVERSE) ? (style & ~CELL_INVERSE) + HL_MATCH + 1 : style;
+        abAppend(ab, E.styleEscape[index], E.styleLength[index]);
+        pen = style;
+      }
+
+      int run = i;
+
+      while (run < lineEnd && E.frame[run].style == style && (E.frame[run].ch != E.shadow[run].ch || E.frame[run].style != E.shadow[run].style)) {
+        run++;
+      }
+
+      if (!abReserve(ab, (run - i) * 4)) {
+        return;
+      }
+
+      for (; i < run; i++) {
+        if (E.frame[i].ch != CELL_WIDE_TAIL) {
+          ab->len += editorEncodeUtf8(E.frame[i].ch, &ab->b[ab->len]);
+        }
+
+        E.shadow[i] = E.frame[i];
+      }
+    }
+  }
+
+  if (pen != -1) {
+    abAppend(ab, "\x1b[m", 3);
   }
 }
 
 void editorRefreshScreen() {
+  static struct abuf ab = ABUF_INIT;
+
   editorScroll();
-  struct abuf ab = ABUF_INIT;
+  ab.len = 0;
 
   abAppend(&ab, "\x1b[?25l", 6);
-  abAppend(&ab, "\x1b[H", 3);
-
-  editorDrawRows(&ab);
-  editorDrawStatusBar(&ab);
-  editorDrawMessageBar(&ab);
 
-  char buf[32];
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cursorY - E.rowoff) + 1, (E.rx - E.coloff) + 1);
-  abAppend(&ab, buf, strlen(buf));
+  editorDrawRows();
+  editorDrawStatusBar();
+  editorDrawMessageBar();
+  editorFlushFrame(&ab);
 
+  abAppendCursor(&ab, (E.cursorY - E.rowoff) + 1, (E.rx - E.coloff) + 1);
   abAppend(&ab, "\x1b[?25h", 6);
 
-  write(STDOUT_FILENO, ab.b, ab.len);
+  int written = 0;
+
+  while (written < ab.len) {
+    ssize_t n = write(STDOUT_FILENO, ab.b + written, ab.len - written);
+
+    if (n == -1 && errno != EINTR && errno != EAGAIN) {
+      break;
+    }
 
-  abFree(&ab);
+    if (n > 0) {
+      written += n;
+    }
+  }
 }
 
 void editorSetStatusMessage(const char *fmt, ...) {
@@ -1037,9 +5318,9 @@ void editorSetStatusMessage(const char *fmt, ...) {
   E.statusmsg_time = time(NULL);
 }
 
-/*** Section 14: Input ***/
+/*** Section 16: Input ***/
 
-char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
+char *editorPrompt(char *prompt, void (*callback)(char *, int), int allowEmpty) {
   size_t bufsize = 128;
   char *buf = malloc(bufsize);
 
@@ -1048,7 +5329,10 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
 
   while (1) {
     editorSetStatusMessage(prompt, buf);
-    editorRefreshScreen();
+
+    if (!editorKeysPending()) {
+      editorRefreshScreen();
+    }
 
     int c = editorReadKey();
     if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
@@ -1066,7 +5350,7 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
 
       return NULL;
     } else if (c == '\r') {
-      if (buflen != 0) {
+      if (buflen != 0 || allowEmpty) {
         editorSetStatusMessage("");
 
         if (callback) {
@@ -1091,19 +5375,72 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
   }
 }
 
+void editorPaste() {
+  struct abuf text = ABUF_INIT;
+  struct timespec last, now;
+
+  clock_gettime(CLOCK_MONOTONIC, &last);
+  E.pasteOpen = 1;
+
+  while (1) {
+    char *seq = &E.input[E.inputPos];
+    int avail = E.inputLen - E.inputPos;
+    char *close = memmem(seq, avail, "\x1b[201~", 6);
+    int take = close ? close - seq : (avail > 5 ? avail - 5 : 0);
+
+    abAppend(&text, seq, take);
+    E.inputPos += take;
+
+    if (close) {
+      E.inputPos += 6;
+      E.pasteOpen = 0;
+      break;
+    }
+
+    if (editorReadInput()) {
+      clock_gettime(CLOCK_MONOTONIC, &last);
+      continue;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if ((now.tv_sec - last.tv_sec) * 1000 + (now.tv_nsec - last.tv_nsec) / 1000000 >= WRITEAM_PASTE_TIMEOUT) {
+      int held = E.inputLen - E.inputPos;
+
+      while (held > 0 && memcmp(&E.input[E.inputLen - held], "\x1b[201~", held) != 0) {
+        held--;
+      }
+
+      abAppend(&text, &E.input[E.inputPos], E.inputLen - E.inputPos - held);
+      E.inputPos = E.inputLen - held;
+      break;
+    }
+  }
+
+  if (text.len > 0) {
+    editorInsertText(text.b, text.len);
+  }
+
+  if (E.pasteOpen) {
+    editorSetStatusMessage("Paste stalled; waiting for the terminal to finish it");
+  }
+
+  free(text.b);
+}
+
 void editorMoveCursor(int key) {
-  erow *row = (E.cursorY >= E.numRows) ? NULL : &E.row[E.cursorY];
+  erow *row = docRowAt(E.cursorY);
 
   switch (key) {
     case ARROW_LEFT:
       if (E.cursorX
      !=0) {
         E.cursorX
-    --;
+     = editorRowPrevChar(row, E.cursorX);
       } else if (E.cursorY > 0){
         E.cursorY--;
         E.cursorX
-     = E.row[E.cursorY].size;
+     = docRowAt(E.cursorY)->size;
       }
 
       break;
@@ -1111,7 +5448,7 @@ void editorMoveCursor(int key) {
       if (row && E.cursorX
      < row->size) {
         E.cursorX
-    ++;
+     = editorRowNextChar(row, E.cursorX);
       } else if (row && E.cursorX
      == row->size) {
         E.cursorY++;
@@ -1133,7 +5470,7 @@ void editorMoveCursor(int key) {
       break;
   }
 
-  row = (E.cursorY >= E.numRows) ? NULL : &E.row[E.cursorY];
+  row = docRowAt(E.cursorY);
   int rowLength = row ? row->size : 0;
 
   if (E.cursorX
@@ -1141,12 +5478,19 @@ void editorMoveCursor(int key) {
     E.cursorX
  = rowLength;
   }
+
+  if (row && E.cursorX < rowLength) {
+    E.cursorX = editorRowCharStart(row, E.cursorX);
+  }
 }
 
 void editorProcessKeypress() {
   static int quit_times = WRITEAM_QUIT_TIMES;
 
   int c = editorReadKey();
+  E.undoGroup++;
+  E.undoCursorX = E.cursorX;
+  E.undoCursorY = E.cursorY;
 
   switch (c) {
     case '\r':
@@ -1154,11 +5498,14 @@ void editorProcessKeypress() {
       break;
 
     case CTRL_KEY('q'):
+      editorSaveWait();
+
       if (E.dirty && quit_times > 0) {
         editorSetStatusMessage("WARNING: File has unsaved changes. Press Ctrl-Q %d more times to quit.", quit_times);
         quit_times--;
         return;
       }
+      editorJournalDiscard();
       write(STDOUT_FILENO, "\x1b[2J", 4);
       write(STDOUT_FILENO, "\x1b[H", 3);
       exit(0);
@@ -1176,13 +5523,25 @@ void editorProcessKeypress() {
     case END_KEY:
       if (E.cursorY < E.numRows) {
         E.cursorX
-     = E.row[E.cursorY].size;
+     = docRowAt(E.cursorY)->size;
       }
       break;
     
     case CTRL_KEY('f'):
       editorFind();
       break;
+
+    case CTRL_KEY('r'):
+      editorReplace();
+      break;
+
+    case CTRL_KEY('z'):
+      editorUndo();
+      break;
+
+    case CTRL_KEY('y'):
+      editorRedo();
+      break;
     
     case BACKSPACE:
     case CTRL_KEY('h'):
@@ -1226,8 +5585,13 @@ void editorProcessKeypress() {
       editorMoveCursor(c);
       break;
 
+    case PASTE_START:
+      editorPaste();
+      break;
+
     case CTRL_KEY('l'):
     case '\x1b':
+    case PASTE_END:
       break;
     
     default:
@@ -1236,9 +5600,13 @@ void editorProcessKeypress() {
   }
 
   quit_times = WRITEAM_QUIT_TIMES;
+
+  if (E.gapRow && E.gapRow != docRowAt(E.cursorY)) {
+    editorRowCloseGap(E.gapRow);
+  }
 }
 
-/*** Section 15: Init ***/
+/*** Section 17: Init ***/
 
 void initEditor() {
   E.cursorX = 0;
@@ -1247,33 +5615,141 @@ void initEditor() {
   E.rowoff = 0;
   E.coloff = 0;
   E.numRows = 0;
-  E.row = NULL;
+  E.root = NULL;
+  E.freeRows = NULL;
+  E.rowById = NULL;
+  E.numRowIds = 0;
+  E.rowIdCap = 0;
+  E.freeRowIds = NULL;
+  E.numFreeRowIds = 0;
+  E.freeRowIdCap = 0;
+  E.gapRow = NULL;
+  E.staleRows = NULL;
+  E.numStaleRows = 0;
+  E.hlFrontier = NULL;
+  E.matchRow = NULL;
+  E.matchAt = 0;
+  E.matchLen = 0;
+  E.matchCount = -1;
+  E.matchNumber = 0;
+  E.findRegex = 0;
+  E.index = NULL;
+  E.indexFrontier = NULL;
+  E.indexDirty = NULL;
+  E.numIndexDirty = 0;
+  E.indexDirtyCap = 0;
+  E.undo = NULL;
+  E.undoHead = 0;
+  E.undoLast = -1;
+  E.undoCurrent = 0;
+  E.undoTail = 0;
+  E.undoGroup = 0;
+  E.undoCursorX = 0;
+  E.undoCursorY = 0;
+  E.undoDropGroup = -1;
+  E.undoReplaying = 0;
+  E.undoRow = NULL;
+  E.hlIdle = 0;
+  E.hlBusy = 0;
+  E.hlPending = 0;
+  E.hlRedraw = 0;
+  E.map = NULL;
+  E.mapSize = 0;
+  E.stream = NULL;
+  E.followFile = -1;
+  E.followFd = -1;
+  E.followWatch = -1;
+  E.followOffset = 0;
+  E.save = NULL;
+  E.saveGeneration = 0;
+  E.saveProgress = 0;
+  E.journalName = NULL;
+  E.journalFd = -1;
+  E.journal = NULL;
+  E.journalKept = 0;
+  E.hlWindow = NULL;
+  E.hlWindowCap = 0;
+  E.journalLen = 0;
+  E.journalCap = 0;
+  E.journalReplaying = 0;
   E.dirty = 0;
   E.fileName = NULL;
+  E.inputLen = 0;
+  E.inputPos = 0;
+  E.pasteOpen = 0;
   E.statusmsg[0] = '\0';
   E.statusmsg_time = 0;
   E.syntax = NULL;
+  E.keywordTable = NULL;
+  E.keywordMask = 0;
+  E.keywordSeed = 0;
+  E.keywordMaxLength = 0;
 
   if (getWindowSize(&E.screenRows, &E.screenCols) == -1) {
     die("getWindowSize");
   }
 
   E.screenRows -= 2;
+
+  int numCells = (E.screenRows + 2) * E.screenCols;
+  E.frame = calloc(numCells, sizeof(struct editorCell));
+  E.shadow = malloc(sizeof(struct editorCell) * numCells);
+  memset(E.shadow, 0xff, sizeof(struct editorCell) * numCells);
+  editorInitStyles();
+
+  pthread_t worker;
+
+  if (pthread_mutex_init(&E.hlLock, NULL) != 0 || pthread_cond_init(&E.hlCond, NULL) != 0 || pthread_create(&worker, NULL, editorHighlightWorker, NULL) != 0) {
+    die("pthread_create");
+  }
+
+  pthread_detach(worker);
 }
 
 int main(int argc, char *argv[]) {
+  int streamFd = -1;
+  int follow = 0;
+
+  if (argc >= 3 && strcmp(argv[1], "-f") == 0) {
+    follow = 1;
+    argc--;
+    argv++;
+  }
+
+  if (argc >= 2 && strcmp(argv[1], "-") == 0) {
+    streamFd = editorTakeStdin();
+  }
+
   enableRawMode();
   initEditor();
 
-  if (argc >= 2) {
+  if (streamFd != -1) {
+    editorOpenStream(streamFd);
+  } else if (argc >= 2) {
     editorOpen(argv[1]);
+
+    if (follow) {
+      editorFollowStart();
+    }
+
+    editorJournalOpen();
   }
 
-  editorSetStatusMessage("HELP: Ctrl-S = Save | Ctrl-Q = Quit | Ctrl-F = Find");
+  if (E.statusmsg[0] == '\0') {
+    editorSetStatusMessage("HELP: Ctrl-S = Save | Ctrl-Q = Quit | Ctrl-F = Find | Ctrl-R = Replace | Ctrl-Z = Undo");
+  }
   
   while (1) {
+    editorStreamPoll();
+    editorFollowPoll();
+    editorSavePoll();
+    editorJournalFlush(0);
     editorRefreshScreen();
-    editorProcessKeypress();
+
+    do {
+      editorProcessKeypress();
+      editorScroll();
+    } while (editorKeysPending());
   }
 
   return 0;